@@ -3,6 +3,7 @@
 #include "console.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -10,19 +11,42 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "cpucycles.h"
 #include "report.h"
+#include "tinyweb.h"
+
+/* Our program needs to use regular malloc/free */
+#define INTERNAL 1
+#include "harness.h"
 
 /* Some global values */
 int simulation = 0;
 static cmd_ptr cmd_list = NULL;
 static param_ptr param_list = NULL;
+
+/*
+ * Open-addressing hash tables mapping names to commands and parameters,
+ * with linear probing.  The sorted lists above still drive help output.
+ */
+typedef struct {
+    const char **names;
+    void **items;
+    size_t cap; /* Power of 2 */
+    size_t cnt;
+} name_table_t;
+
+#define NAME_TABLE_INIT_CAP 64
+static name_table_t cmd_table;
+static name_table_t param_table;
 static bool block_flag = false;
-static bool prompt_flag = true;
 
 /* Am I timing a command that has the console blocked? */
 static bool block_timing = false;
@@ -34,24 +58,95 @@ static double last_time;
 /*
  * Implement buffered I/O using variant of RIO package from CS:APP
  * Must create stack of buffers to handle I/O with nested source commands.
+ * Regular files are mapped into memory instead and split with memchr.
  */
 
 #define RIO_BUFSIZE 8192
 typedef struct RIO_ELE rio_t, *rio_ptr;
 
+/*
+ * Command files compiled by compile_file.  A program starts with a
+ * prog_header_t, followed by the code and then the interned strings, each
+ * ending with a null character.  Each instruction is its argument count
+ * followed by the index of every argument among the strings, all as LEB128
+ * varints.  Command names are resolved once, when the program is loaded.
+ */
+#define PROG_MAGIC "QTBC"
+#define PROG_VERSION 1
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t code_bytes;
+    uint32_t str_cnt;
+    uint32_t str_bytes;
+} prog_header_t;
+
+typedef struct {
+    char *strs;          /* Copy of interned strings */
+    size_t str_bytes;    /* Size of strs */
+    uint32_t str_cnt;    /* Number of strings */
+    char **str_ptrs;     /* Start of each string in strs */
+    cmd_ptr *cmds;       /* Command named by each string, or NULL */
+    const uint8_t *pc;   /* Next instruction in mapping */
+    const uint8_t *end;  /* End of code in mapping */
+} program_t;
+
 struct RIO_ELE {
     int fd;                /* File descriptor */
     int cnt;               /* Unread bytes in internal buffer */
     char *bufptr;          /* Next unread byte in internal buffer */
     char buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *map;             /* Mapped file contents, or NULL */
+    size_t map_len;        /* Size of mapping */
+    size_t map_pos;        /* Offset of next unread byte in mapping */
+    program_t *prog;       /* Program held by mapping, or NULL */
     rio_ptr prev;          /* Next element in stack */
 };
 
 static rio_ptr buf_stack;
 static char linebuf[RIO_BUFSIZE];
 
-/* Maximum file descriptor */
-static int fd_max = 0;
+/*
+ * Event loop.  One epoll instance watches the command input, the tinyweb
+ * listener, its client connections and a timer.  The data of each event
+ * points to the ev_src_t describing its file descriptor.
+ */
+typedef enum { SRC_INPUT, SRC_LISTEN, SRC_CONN, SRC_TIMER } src_kind_t;
+
+typedef struct {
+    src_kind_t kind;
+    int fd; /* -1 when not watched */
+} ev_src_t;
+
+/* Size of buffer holding the headers of a web request */
+#define WEB_REQ_MAX 4096
+/* Timer ticks, one per second, a connection may stay idle */
+#define WEB_IDLE_TICKS 5
+
+typedef struct WEB_CONN web_conn_t;
+struct WEB_CONN {
+    ev_src_t src;            /* Must come first */
+    unsigned long tick;      /* Timer tick of last activity */
+    size_t len;              /* Bytes of request received */
+    char req[WEB_REQ_MAX];   /* Request received so far */
+    web_conn_t *next;        /* Next open connection */
+};
+
+static int epfd = -1;
+static ev_src_t input_src = {SRC_INPUT, -1};
+static ev_src_t listen_src = {SRC_LISTEN, -1};
+static ev_src_t timer_src = {SRC_TIMER, -1};
+static web_conn_t *web_conns = NULL;
+static unsigned long web_tick = 0;
+/* Listener owned by the web command */
+static int *web_fd = NULL;
+
+/* Line being edited at the terminal, fed by input events */
+static struct linenoiseState edit_state;
+static char edit_buf[RIO_BUFSIZE];
+static bool editing = false;
+static bool edit_hidden = false;
 
 /* Parameters */
 static int err_limit = 5;
@@ -60,7 +155,6 @@ static int echo = 0;
 
 static bool quit_flag = false;
 static char *prompt = "cmd> ";
-static bool has_infile = false;
 
 /* Optional function to call as part of exit process */
 /* Maximum number of quit functions */
@@ -73,9 +167,72 @@ static void init_in();
 
 static bool push_file(char *fname);
 static void pop_file();
+static void input_unwatch();
+static void free_program(program_t *p);
+static program_t *load_program(const char *map, size_t len);
 
 static bool interpret_cmda(int argc, char *argv[]);
 
+/* FNV-1a */
+static size_t name_hash(const char *name)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 0x100000001b3ULL;
+    }
+    return (size_t) h;
+}
+
+/* Return slot holding name, or the empty slot where name would go */
+static size_t table_slot(name_table_t *t, const char *name)
+{
+    size_t i = name_hash(name) & (t->cap - 1);
+    while (t->names[i] && strcmp(t->names[i], name))
+        i = (i + 1) & (t->cap - 1);
+    return i;
+}
+
+static void *table_find(name_table_t *t, const char *name)
+{
+    return t->cap ? t->items[table_slot(t, name)] : NULL;
+}
+
+static void table_free(name_table_t *t)
+{
+    if (t->cap) {
+        free_array(t->names, t->cap, sizeof(char *));
+        free_array(t->items, t->cap, sizeof(void *));
+    }
+    t->names = NULL;
+    t->items = NULL;
+    t->cap = t->cnt = 0;
+}
+
+/* Map name to item, replacing any earlier item of that name */
+static void table_add(name_table_t *t, const char *name, void *item)
+{
+    /* Keep load factor at most 1/2 */
+    if (2 * (t->cnt + 1) > t->cap) {
+        name_table_t old = *t;
+        t->cap = old.cap ? 2 * old.cap : NAME_TABLE_INIT_CAP;
+        t->names = calloc_or_fail(t->cap, sizeof(char *), "table_add");
+        t->items = calloc_or_fail(t->cap, sizeof(void *), "table_add");
+        t->cnt = 0;
+        for (size_t i = 0; i < old.cap; i++) {
+            if (old.names[i])
+                table_add(t, old.names[i], old.items[i]);
+        }
+        table_free(&old);
+    }
+
+    size_t i = table_slot(t, name);
+    if (!t->names[i])
+        t->cnt++;
+    t->names[i] = name;
+    t->items[i] = item;
+}
+
 /* Add a new command */
 void add_cmd(char *name, cmd_function operation, char *documentation)
 {
@@ -90,8 +247,11 @@ void add_cmd(char *name, cmd_function operation, char *documentation)
     ele->name = name;
     ele->operation = operation;
     ele->documentation = documentation;
+    ele->mem_peak = 0;
+    ele->lat = NULL;
     ele->next = next_cmd;
     *last_loc = ele;
+    table_add(&cmd_table, name, ele);
 }
 
 /* Add a new parameter */
@@ -114,52 +274,64 @@ void add_param(char *name,
     ele->setter = setter;
     ele->next = next_param;
     *last_loc = ele;
+    table_add(&param_table, name, ele);
 }
 
-/* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp)
+/* Argument vector shared by all command lines, grown as needed */
+static char **argv_buf = NULL;
+static int argv_cap = 0;
+
+/* Make room for at least n arguments in vector *argvp of capacity *capp */
+static void argv_reserve(char ***argvp, int *capp, int n)
+{
+    if (n <= *capp)
+        return;
+    int cap = *capp ? *capp : 16;
+    while (cap < n)
+        cap *= 2;
+    char **argv = calloc_or_fail(cap, sizeof(char *), "argv_reserve");
+    if (*capp) {
+        memcpy(argv, *argvp, *capp * sizeof(char *));
+        free_array(*argvp, *capp, sizeof(char *));
+    }
+    *argvp = argv;
+    *capp = cap;
+}
+
+/*
+ * Split line into arguments in place, ending each with a null character.
+ * The arguments are stored in vector *argvp, grown as needed.
+ */
+static int split_args(char *line, char ***argvp, int *capp)
 {
-    /*
-     * Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
     char *src = line;
-    char *dst = buf;
-    bool skipping = true;
-    int c;
     int argc = 0;
-    while ((c = *src++) != '\0') {
-        if (isspace(c)) {
-            if (!skipping) {
-                /* Hit end of word */
-                *dst++ = '\0';
-                skipping = true;
-            }
-        } else {
-            if (skipping) {
-                /* Hit start of new word */
-                argc++;
-                skipping = false;
-            }
-            *dst++ = c;
-        }
-    }
+    while (true) {
+        while (isspace((unsigned char) *src))
+            src++;
+        if (*src == '\0')
+            break;
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
+        argv_reserve(argvp, capp, argc + 1);
+        (*argvp)[argc++] = src;
+
+        while (*src != '\0' && !isspace((unsigned char) *src))
+            src++;
+        if (*src != '\0')
+            *src++ = '\0';
     }
 
-    free_block(buf, len + 1);
-    *argcp = argc;
-    return argv;
+    return argc;
+}
+
+/*
+ * Split line into arguments in place.
+ * The returned vector points into line and is reused by the next call.
+ */
+static char **parse_args(char *line, int *argcp)
+{
+    *argcp = split_args(line, &argv_buf, &argv_cap);
+    return argv_buf;
 }
 
 static void record_error()
@@ -171,18 +343,125 @@ static void record_error()
     }
 }
 
-/* Execute a command that has already been split into arguments */
-static bool interpret_cmda(int argc, char *argv[])
+/*
+ * Log-linear latency histogram, in the style of HdrHistogram.  Latencies
+ * are counted in cycles of the CPU's counter, which is cheaper to read than
+ * the clock, and converted to nanoseconds when summarized.  Each latency
+ * below LAT_LINEAR cycles has a bucket of its own, and every power of 2
+ * above is split into LAT_SUB buckets, so a bucket is never wider than
+ * about 3% of the latencies it holds.  Longer latencies than LAT_MAX_BIT
+ * allows, several minutes, count as the longest.
+ */
+#define LAT_SUB_BITS 5
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_LINEAR (2 * LAT_SUB)
+#define LAT_MAX_BIT 40
+#define LAT_BUCKETS (LAT_LINEAR + (LAT_MAX_BIT - LAT_SUB_BITS) * LAT_SUB)
+
+typedef struct LAT_HIST {
+    uint64_t cnt;
+    uint64_t sum; /* Total cycles */
+    uint64_t max;
+    uint64_t buckets[LAT_BUCKETS];
+} lat_hist_t;
+
+/* Summary of histogram, in nanoseconds */
+typedef struct {
+    uint64_t mean, p50, p99, p999, max;
+} lat_summary_t;
+
+static char *stats_file = NULL;
+
+/* Counter and clock read together when interpreter started */
+static int64_t start_cycles;
+static uint64_t start_ns;
+
+static size_t lat_bucket(uint64_t cycles)
+{
+    if (cycles < LAT_LINEAR)
+        return cycles;
+    if (cycles >> (LAT_MAX_BIT + 1))
+        cycles = (2ULL << LAT_MAX_BIT) - 1;
+    int bit = 63 - __builtin_clzll(cycles);
+    int shift = bit - LAT_SUB_BITS;
+    return LAT_LINEAR + (bit - LAT_SUB_BITS - 1) * LAT_SUB +
+           (cycles >> shift) - LAT_SUB;
+}
+
+/* Return most cycles counted in bucket i */
+static uint64_t lat_bucket_max(size_t i)
+{
+    if (i < LAT_LINEAR)
+        return i;
+    size_t octave = (i - LAT_LINEAR) / LAT_SUB;
+    size_t sub = (i - LAT_LINEAR) % LAT_SUB;
+    int shift = octave + 1;
+    return ((LAT_SUB + sub + 1) << shift) - 1;
+}
+
+static void lat_record(cmd_ptr cmd, uint64_t cycles)
+{
+    lat_hist_t *h = cmd->lat;
+    if (!h)
+        h = cmd->lat = calloc_or_fail(1, sizeof(lat_hist_t), "lat_record");
+    h->cnt++;
+    h->sum += cycles;
+    if (cycles > h->max)
+        h->max = cycles;
+    h->buckets[lat_bucket(cycles)]++;
+}
+
+/* Return latency below which permille thousandths of latencies fall */
+static uint64_t lat_percentile(lat_hist_t *h, uint64_t permille)
+{
+    uint64_t rank = (h->cnt * permille + 999) / 1000;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank && seen) {
+            uint64_t cycles = lat_bucket_max(i);
+            return cycles < h->max ? cycles : h->max;
+        }
+    }
+    return h->max;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void lat_summarize(lat_hist_t *h, lat_summary_t *s)
+{
+    /* Rate of counter over the run so far */
+    int64_t cycles = cpucycles() - start_cycles;
+    double ns_per_cycle = cycles > 0 ? (double) (now_ns() - start_ns) / cycles
+                                     : 1.0;
+    s->mean = h->sum / h->cnt * ns_per_cycle;
+    s->p50 = lat_percentile(h, 500) * ns_per_cycle;
+    s->p99 = lat_percentile(h, 990) * ns_per_cycle;
+    s->p999 = lat_percentile(h, 999) * ns_per_cycle;
+    s->max = h->max * ns_per_cycle;
+}
+
+/* Run command cmd, or report it unknown if NULL */
+static bool run_cmd(cmd_ptr cmd, int argc, char *argv[])
 {
-    if (argc == 0)
-        return true;
-    /* Try to find matching command */
-    cmd_ptr next_cmd = cmd_list;
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
-    if (next_cmd) {
-        ok = next_cmd->operation(argc, argv);
+    if (cmd) {
+        int64_t start = cpucycles();
+        mem_window_start();
+        ok = cmd->operation(argc, argv);
+        size_t peak = mem_window_peak();
+        int64_t cycles = cpucycles() - start;
+        /* Quitting frees the commands */
+        if (!quit_flag) {
+            if (peak > cmd->mem_peak)
+                cmd->mem_peak = peak;
+            lat_record(cmd, cycles > 0 ? cycles : 0);
+        }
         if (!ok)
             record_error();
     } else {
@@ -190,10 +469,294 @@ static bool interpret_cmda(int argc, char *argv[])
         record_error();
         ok = false;
     }
+    report_flush();
 
     return ok;
 }
 
+/*
+ * Blocks of repeat commands.  The lines of a block are split up once as they
+ * are read, and a nested block becomes a statement of the enclosing one, so
+ * running a block only walks its statements.
+ */
+typedef struct LOOP_ELE loop_t;
+
+typedef struct {
+    cmd_ptr cmd;     /* Command to run, NULL if unknown */
+    int argc;        /* Number of arguments */
+    char **argv;     /* Saved arguments */
+    char **args;     /* Arguments with counters substituted, or NULL */
+    char *text;      /* Storage for substituted arguments */
+    size_t text_len; /* Size of text */
+    loop_t *body;    /* Nested block to run instead of command, or NULL */
+} stmt_t;
+
+struct LOOP_ELE {
+    int count;      /* Number of iterations */
+    char *var;      /* Name of counter, or NULL */
+    int value;      /* Current value of counter */
+    stmt_t *stmts;  /* Statements in order */
+    int stmt_cnt;   /* Number of statements */
+    int stmt_cap;   /* Capacity of stmts */
+    loop_t *parent; /* Enclosing block, or NULL */
+};
+
+/* Innermost block being read, NULL when commands run as they are read */
+static loop_t *loop_open = NULL;
+
+/* Most characters of a counter value, "-2147483648" */
+#define COUNTER_CHARS 11
+
+static void loop_free(loop_t *l)
+{
+    for (int i = 0; i < l->stmt_cnt; i++) {
+        stmt_t *s = &l->stmts[i];
+        if (s->body) {
+            loop_free(s->body);
+            continue;
+        }
+        for (int j = 0; j < s->argc; j++)
+            free_string(s->argv[j]);
+        free_array(s->argv, s->argc, sizeof(char *));
+        if (s->args) {
+            free_array(s->args, s->argc, sizeof(char *));
+            free_block(s->text, s->text_len);
+        }
+    }
+    if (l->stmt_cap)
+        free_array(l->stmts, l->stmt_cap, sizeof(stmt_t));
+    if (l->var)
+        free_string(l->var);
+    free_block(l, sizeof(loop_t));
+}
+
+/* Drop the blocks being read, including the enclosing ones */
+static void loop_discard()
+{
+    loop_t *l = loop_open;
+    while (l && l->parent)
+        l = l->parent;
+    if (l)
+        loop_free(l);
+    loop_open = NULL;
+}
+
+/* Append empty statement to block */
+static stmt_t *loop_add(loop_t *l)
+{
+    if (l->stmt_cnt == l->stmt_cap) {
+        int cap = l->stmt_cap ? 2 * l->stmt_cap : 8;
+        stmt_t *stmts = calloc_or_fail(cap, sizeof(stmt_t), "loop_add");
+        if (l->stmt_cap) {
+            memcpy(stmts, l->stmts, l->stmt_cap * sizeof(stmt_t));
+            free_array(l->stmts, l->stmt_cap, sizeof(stmt_t));
+        }
+        l->stmts = stmts;
+        l->stmt_cap = cap;
+    }
+    return &l->stmts[l->stmt_cnt++];
+}
+
+/* Return length of the counter name starting s, 0 if there is none */
+static size_t var_len(const char *s)
+{
+    size_t n = 0;
+    if (isalpha((unsigned char) *s) || *s == '_') {
+        while (isalnum((unsigned char) s[n]) || s[n] == '_')
+            n++;
+    }
+    return n;
+}
+
+/*
+ * Start reading the block of "repeat count [var] {", nested in the block
+ * being read if any.  Return false if the command is malformed.
+ */
+static bool loop_begin(int argc, char *argv[])
+{
+    int count;
+    if ((argc != 3 && argc != 4) || strcmp(argv[argc - 1], "{")) {
+        report(1, "Usage: repeat count [var] {");
+        return false;
+    }
+    if (!get_int(argv[1], &count) || count < 0) {
+        report(1, "Invalid repeat count '%s'", argv[1]);
+        return false;
+    }
+    if (argc == 4 && var_len(argv[2]) != strlen(argv[2])) {
+        report(1, "Invalid counter name '%s'", argv[2]);
+        return false;
+    }
+
+    loop_t *l = calloc_or_fail(1, sizeof(loop_t), "loop_begin");
+    l->count = count;
+    if (argc == 4)
+        l->var = strsave_or_fail(argv[2], "loop_begin");
+    l->parent = loop_open;
+    if (loop_open)
+        loop_add(loop_open)->body = l;
+    loop_open = l;
+    return true;
+}
+
+/* Find block of l or enclosing it whose counter is the n characters at s */
+static loop_t *loop_find(loop_t *l, const char *s, size_t n)
+{
+    for (; l; l = l->parent) {
+        if (l->var && !strncmp(l->var, s, n) && l->var[n] == '\0')
+            return l;
+    }
+    return NULL;
+}
+
+/* Substitute current value of counters for each $var in arguments */
+static char **stmt_expand(stmt_t *s, loop_t *l)
+{
+    char *dst = s->text;
+    for (int i = 0; i < s->argc; i++) {
+        s->args[i] = dst;
+        const char *src = s->argv[i];
+        while (*src) {
+            size_t n = *src == '$' ? var_len(src + 1) : 0;
+            loop_t *v = n ? loop_find(l, src + 1, n) : NULL;
+            if (v) {
+                dst += sprintf(dst, "%d", v->value);
+                src += n + 1;
+            } else {
+                *dst++ = *src++;
+            }
+        }
+        *dst++ = '\0';
+    }
+    return s->args;
+}
+
+/* Run statements of block count times.  Return false if any failed */
+static bool loop_run(loop_t *l)
+{
+    bool ok = true;
+    for (l->value = 0; l->value < l->count && !quit_flag; l->value++) {
+        for (int i = 0; i < l->stmt_cnt && !quit_flag; i++) {
+            stmt_t *s = &l->stmts[i];
+            if (s->body) {
+                ok = loop_run(s->body) && ok;
+                continue;
+            }
+            char **argv = s->args ? stmt_expand(s, l) : s->argv;
+            ok = run_cmd(s->cmd, s->argc, argv) && ok;
+        }
+    }
+    return ok;
+}
+
+/*
+ * Record command in the block being read.  Closing the outermost block runs
+ * it.  Return false if the command is malformed or the block failed.
+ */
+static bool loop_record(int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+
+    if (!strcmp(argv[0], "}")) {
+        loop_t *l = loop_open;
+        loop_open = l->parent;
+        if (loop_open)
+            return true;
+        bool ok = loop_run(l);
+        loop_free(l);
+        return ok;
+    }
+
+    if (!strcmp(argv[0], "repeat")) {
+        if (loop_begin(argc, argv))
+            return true;
+        /* Running the rest would no longer match the nesting intended */
+        loop_discard();
+        record_error();
+        return false;
+    }
+
+    stmt_t *s = loop_add(loop_open);
+    s->cmd = table_find(&cmd_table, argv[0]);
+    s->argc = argc;
+    s->argv = calloc_or_fail(argc, sizeof(char *), "loop_record");
+    size_t text_len = 0;
+    bool expand = false;
+    for (int i = 0; i < argc; i++) {
+        s->argv[i] = strsave_or_fail(argv[i], "loop_record");
+        text_len += strlen(argv[i]) + 1;
+        for (const char *c = argv[i]; (c = strchr(c, '$')); c++) {
+            text_len += COUNTER_CHARS;
+            expand = true;
+        }
+    }
+    if (expand) {
+        s->args = calloc_or_fail(argc, sizeof(char *), "loop_record");
+        s->text = malloc_or_fail(text_len, "loop_record");
+        s->text_len = text_len;
+    }
+    return true;
+}
+
+/* Execute a command that has already been split into arguments */
+static bool interpret_cmda(int argc, char *argv[])
+{
+    if (loop_open)
+        return loop_record(argc, argv);
+    if (argc == 0)
+        return true;
+    return run_cmd(table_find(&cmd_table, argv[0]), argc, argv);
+}
+
+void report_cmd_mem(int vlevel)
+{
+    report(vlevel, "%-12s %12s", "command", "peak bytes");
+    for (cmd_ptr clist = cmd_list; clist; clist = clist->next) {
+        if (clist->mem_peak)
+            report(vlevel, "%-12s %12lu", clist->name, clist->mem_peak);
+    }
+}
+
+void set_stats_file(char *file_name)
+{
+    stats_file = file_name;
+}
+
+/* Write latencies of every command that ran as JSON */
+static bool write_stats(char *file_name)
+{
+    FILE *out = fopen(file_name, "w");
+    if (!out) {
+        report(1, "Couldn't open stats file '%s'", file_name);
+        return false;
+    }
+
+    fprintf(out, "{\n  \"unit\": \"ns\",\n  \"commands\": [");
+    bool first = true;
+    for (cmd_ptr clist = cmd_list; clist; clist = clist->next) {
+        if (!clist->lat)
+            continue;
+        lat_summary_t s;
+        lat_summarize(clist->lat, &s);
+        fprintf(out,
+                "%s\n    {\"name\": \"%s\", \"count\": %" PRIu64
+                ", \"mean\": %" PRIu64 ", \"p50\": %" PRIu64
+                ", \"p99\": %" PRIu64 ", \"p99.9\": %" PRIu64
+                ", \"max\": %" PRIu64 "}",
+                first ? "" : ",", clist->name, clist->lat->cnt, s.mean, s.p50,
+                s.p99, s.p999, s.max);
+        first = false;
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    if (fclose(out)) {
+        report(1, "Error writing stats file '%s'", file_name);
+        return false;
+    }
+    return true;
+}
+
 /* Execute a command from a command line */
 static bool interpret_cmd(char *cmdline)
 {
@@ -205,12 +768,7 @@ static bool interpret_cmd(char *cmdline)
 #endif
     int argc;
     char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
-
-    return ok;
+    return interpret_cmda(argc, argv);
 }
 
 /* Set function to be executed as part of program exit */
@@ -233,9 +791,13 @@ static bool do_quit(int argc, char *argv[])
 {
     cmd_ptr c = cmd_list;
     bool ok = true;
+    /* Before the commands holding the latencies are freed */
+    bool stats_ok = !stats_file || write_stats(stats_file);
     while (c) {
         cmd_ptr ele = c;
         c = c->next;
+        if (ele->lat)
+            free_block(ele->lat, sizeof(lat_hist_t));
         free_block(ele, sizeof(cmd_ele));
     }
 
@@ -245,16 +807,19 @@ static bool do_quit(int argc, char *argv[])
         p = p->next;
         free_block(ele, sizeof(param_ele));
     }
-
-    while (buf_stack)
-        pop_file();
+    table_free(&cmd_table);
+    table_free(&param_table);
 
     for (int i = 0; i < quit_helper_cnt; i++) {
         ok = ok && quit_helpers[i](argc, argv);
     }
 
+    /* Last, as argv may point into a compiled program on the stack */
+    while (buf_stack)
+        pop_file();
+
     quit_flag = true;
-    return ok;
+    return ok && stats_ok;
 }
 
 static bool do_help(int argc, char *argv[])
@@ -323,7 +888,6 @@ static bool do_option(int argc, char *argv[])
     for (int i = 1; i < argc; i++) {
         char *name = argv[i];
         int value = 0;
-        bool found = false;
         /* Get value from next argument */
         if (i + 1 >= argc) {
             report(1, "No value given for parameter %s", name);
@@ -332,23 +896,16 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_ptr plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
-        }
+        param_ptr plist = table_find(&param_table, name);
         /* Didn't find parameter */
-        if (!found) {
+        if (!plist) {
             report(1, "Unknown parameter '%s'", name);
             return false;
         }
+        int oldval = *plist->valp;
+        *plist->valp = value;
+        if (plist->setter)
+            plist->setter(oldval);
     }
 
     return true;
@@ -376,13 +933,18 @@ static bool do_log(int argc, char *argv[])
         return false;
     }
 
-    bool result = set_logfile(argv[1]);
+    bool result = set_logfile(argv[1], false);
     if (!result)
         report(1, "Couldn't open log file '%s'", argv[1]);
 
     return result;
 }
 
+static bool do_repeat(int argc, char *argv[])
+{
+    return loop_begin(argc, argv);
+}
+
 static bool do_time(int argc, char *argv[])
 {
     double delta = delta_time(&last_time);
@@ -403,11 +965,34 @@ static bool do_time(int argc, char *argv[])
     return ok;
 }
 
+static bool do_stats(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    report(1, "%-12s %10s %10s %10s %10s %10s %10s", "command", "count",
+           "mean us", "p50 us", "p99 us", "p99.9 us", "max us");
+    for (cmd_ptr clist = cmd_list; clist; clist = clist->next) {
+        if (!clist->lat)
+            continue;
+        lat_summary_t s;
+        lat_summarize(clist->lat, &s);
+        report(1, "%-12s %10" PRIu64 " %10.3f %10.3f %10.3f %10.3f %10.3f",
+               clist->name, clist->lat->cnt, s.mean / 1e3, s.p50 / 1e3,
+               s.p99 / 1e3, s.p999 / 1e3, s.max / 1e3);
+    }
+    return true;
+}
+
 /* Initialize interpreter */
 void init_cmd()
 {
     cmd_list = NULL;
     param_list = NULL;
+    table_free(&cmd_table);
+    table_free(&param_table);
     err_cnt = 0;
     quit_flag = false;
 
@@ -417,6 +1002,9 @@ void init_cmd()
     ADD_COMMAND(source, " file           | Read commands from source file");
     ADD_COMMAND(log, " file           | Copy output to file");
     ADD_COMMAND(time, " cmd arg ...    | Time command execution");
+    ADD_COMMAND(stats, "                | Show latency of each command run");
+    ADD_COMMAND(repeat,
+                " n [var] {      | Run lines up to } n times, counting var");
     ADD_COMMAND(hello, "                | hello will print out");
     add_cmd("#", do_comment_cmd, " ...            | Display comment");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
@@ -427,6 +1015,8 @@ void init_cmd()
     init_in();
     init_time(&last_time);
     first_time = last_time;
+    start_cycles = cpucycles();
+    start_ns = now_ns();
 }
 
 /* Create new buffer for named file.
@@ -436,17 +1026,40 @@ void init_cmd()
 static bool push_file(char *fname)
 {
     int fd = fname ? open(fname, O_RDONLY) : STDIN_FILENO;
-    has_infile = fname ? true : false;
     if (fd < 0)
         return false;
 
-    if (fd > fd_max)
-        fd_max = fd;
-
     rio_ptr rnew = malloc_or_fail(sizeof(rio_t), "push_file");
     rnew->fd = fd;
     rnew->cnt = 0;
     rnew->bufptr = rnew->buf;
+    rnew->map = NULL;
+    rnew->map_len = rnew->map_pos = 0;
+
+    /* Pipes and empty files keep using read */
+    struct stat st;
+    if (fname && !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            rnew->map = map;
+            rnew->map_len = st.st_size;
+        }
+    }
+
+    rnew->prog = NULL;
+    if (rnew->map && rnew->map_len >= sizeof(prog_header_t) &&
+        !memcmp(rnew->map, PROG_MAGIC, sizeof(PROG_MAGIC) - 1)) {
+        rnew->prog = load_program(rnew->map, rnew->map_len);
+        if (!rnew->prog) {
+            report(1, "Malformed compiled program '%s'", fname);
+            munmap(rnew->map, rnew->map_len);
+            close(fd);
+            free_block(rnew, sizeof(rio_t));
+            return false;
+        }
+    }
+
     rnew->prev = buf_stack;
     buf_stack = rnew;
 
@@ -459,6 +1072,12 @@ static void pop_file()
     if (buf_stack) {
         rio_ptr rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->prog)
+            free_program(rsave->prog);
+        if (rsave->map)
+            munmap(rsave->map, rsave->map_len);
+        if (rsave->fd == input_src.fd)
+            input_unwatch();
         close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
     }
@@ -470,6 +1089,55 @@ static void init_in()
     buf_stack = NULL;
 }
 
+/*
+ * Copy line at start, among left bytes of text, into buf, ending it with
+ * newline and null character the way readline does.  Lines too long for
+ * buf are split.  Set *nlp to whether the text of line ended in newline.
+ * Return number of bytes of text consumed.
+ */
+static size_t copy_line(char *buf, const char *start, size_t left, bool *nlp)
+{
+    size_t len = left < RIO_BUFSIZE - 2 ? left : RIO_BUFSIZE - 2;
+    const char *nl = memchr(start, '\n', len);
+    if (nl)
+        len = nl - start + 1;
+    memcpy(buf, start, len);
+    size_t end = len;
+    if (!nl)
+        buf[end++] = '\n';
+    buf[end] = '\0';
+    *nlp = nl != NULL;
+    return len;
+}
+
+/*
+ * Copy next line of mapped file into linebuf.  The mapping is read-only:
+ * commands are split up in place, and writing to a private mapping would
+ * copy every page of the file.
+ */
+static char *readline_mapped()
+{
+    rio_ptr r = buf_stack;
+    size_t left = r->map_len - r->map_pos;
+    if (left == 0) {
+        pop_file();
+        return NULL;
+    }
+
+    bool nl;
+    r->map_pos += copy_line(linebuf, r->map + r->map_pos, left, &nl);
+    /* Last line of file did not terminate with newline */
+    if (!nl && r->map_pos == r->map_len)
+        pop_file();
+
+    if (echo) {
+        report_noreturn(1, prompt);
+        report_noreturn(1, linebuf);
+    }
+
+    return linebuf;
+}
+
 /* Read command from input file.
  * When hit EOF, close that file and return NULL
  */
@@ -482,6 +1150,9 @@ static char *readline()
     if (!buf_stack)
         return NULL;
 
+    if (buf_stack->map)
+        return readline_mapped();
+
     for (cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
         if (buf_stack->cnt <= 0) {
             /* Need to read from input file */
@@ -527,78 +1198,269 @@ static char *readline()
     return linebuf;
 }
 
-static bool cmd_done()
+static void free_program(program_t *p)
 {
-    return !buf_stack || quit_flag;
+    if (p->strs)
+        free_block(p->strs, p->str_bytes + 1);
+    if (p->str_ptrs)
+        free_array(p->str_ptrs, p->str_cnt + 1, sizeof(char *));
+    if (p->cmds)
+        free_array(p->cmds, p->str_cnt + 1, sizeof(cmd_ptr));
+    free_block(p, sizeof(program_t));
 }
 
 /*
- * Handle command processing in program that uses select as main control loop.
- * Like select, but checks whether command input either present in internal
- * buffer
- * or readable from command input.  If so, that command is executed.
- * Same return as select.  Command input file removed from readfds
- *
- * nfds should be set to the maximum file descriptor for network sockets.
- * If nfds == 0, this indicates that there is no pending network activity
+ * Load program from mapping of len bytes, resolving command names.
+ * Return NULL if program is malformed.
  */
-int cmd_select(int nfds,
-               fd_set *readfds,
-               fd_set *writefds,
-               fd_set *exceptfds,
-               struct timeval *timeout)
-{
-    int infd;
-    fd_set local_readset;
-
-    if (cmd_done())
-        return 0;
-
-    if (!block_flag) {
-        /* Process any commands in input buffer */
-        if (!readfds)
-            readfds = &local_readset;
-
-        /* Add input fd to readset for select */
-        infd = buf_stack->fd;
-        FD_SET(infd, readfds);
-        if (infd == STDIN_FILENO && prompt_flag) {
-            printf("%s", prompt);
-            fflush(stdout);
-            prompt_flag = true;
+static program_t *load_program(const char *map, size_t len)
+{
+    prog_header_t h;
+    memcpy(&h, map, sizeof(h));
+    if (h.version != PROG_VERSION || h.code_bytes > len - sizeof(h) ||
+        len - sizeof(h) - h.code_bytes != h.str_bytes)
+        return NULL;
+
+    program_t *p = calloc_or_fail(1, sizeof(program_t), "load_program");
+    const char *src = map + sizeof(h) + h.code_bytes;
+    p->str_bytes = h.str_bytes;
+    p->str_cnt = h.str_cnt;
+    p->strs = malloc_or_fail(p->str_bytes + 1, "load_program");
+    memcpy(p->strs, src, p->str_bytes);
+    p->strs[p->str_bytes] = '\0';
+    p->str_ptrs =
+        calloc_or_fail(p->str_cnt + 1, sizeof(char *), "load_program");
+    p->cmds = calloc_or_fail(p->str_cnt + 1, sizeof(cmd_ptr), "load_program");
+
+    char *s = p->strs;
+    char *strs_end = p->strs + p->str_bytes;
+    for (uint32_t i = 0; i < p->str_cnt; i++) {
+        if (s == strs_end) {
+            free_program(p);
+            return NULL;
         }
+        p->str_ptrs[i] = s;
+        p->cmds[i] = table_find(&cmd_table, s);
+        s += strlen(s) + 1;
+    }
+    if (s != strs_end) {
+        free_program(p);
+        return NULL;
+    }
+
+    p->pc = (const uint8_t *) map + sizeof(h);
+    p->end = p->pc + h.code_bytes;
+    return p;
+}
 
-        if (infd >= nfds)
-            nfds = infd + 1;
-    }
-    if (nfds == 0)
-        return 0;
-
-    int result = select(nfds, readfds, writefds, exceptfds, timeout);
-    if (result <= 0)
-        return result;
-
-    infd = buf_stack->fd;
-    if (readfds && FD_ISSET(infd, readfds)) {
-        /* Commandline input available */
-        FD_CLR(infd, readfds);
-        result--;
-        if (has_infile) {
-            char *cmdline;
-            cmdline = readline();
-            if (cmdline)
-                interpret_cmd(cmdline);
+/* Decode varint at p->pc into *wp.  Return false if code ends first */
+static bool read_word(program_t *p, uint32_t *wp)
+{
+    uint32_t w = 0;
+    for (int shift = 0; p->pc < p->end && shift < 32; shift += 7) {
+        uint8_t byte = *p->pc++;
+        w |= (uint32_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *wp = w;
+            return true;
         }
     }
-    return result;
+    return false;
+}
+
+/* Execute next instruction of program on top of input stack */
+static bool run_insn()
+{
+    program_t *p = buf_stack->prog;
+    if (quit_flag)
+        return false;
+    if (p->pc == p->end) {
+        pop_file();
+        return true;
+    }
+
+    /* A line holds at most RIO_BUFSIZE / 2 arguments */
+    uint32_t argc;
+    bool valid = read_word(p, &argc) && argc > 0 && argc <= RIO_BUFSIZE / 2;
+    if (valid)
+        argv_reserve(&argv_buf, &argv_cap, argc);
+    cmd_ptr cmd = NULL;
+    for (uint32_t i = 0; valid && i < argc; i++) {
+        uint32_t idx;
+        valid = read_word(p, &idx) && idx < p->str_cnt;
+        if (valid) {
+            argv_buf[i] = p->str_ptrs[idx];
+            if (i == 0)
+                cmd = p->cmds[idx];
+        }
+    }
+    if (!valid) {
+        report(1, "Malformed instruction in compiled program");
+        pop_file();
+        record_error();
+        return false;
+    }
+
+    if (echo) {
+        report_start();
+        report_add_str(prompt);
+        for (uint32_t i = 0; i < argc; i++) {
+            if (i)
+                report_add_str(" ");
+            report_add_str(argv_buf[i]);
+        }
+        report_end(1);
+    }
+
+    if (loop_open)
+        return loop_record(argc, argv_buf);
+    /* Running the command may pop the program */
+    return run_cmd(cmd, argc, argv_buf);
+}
+
+/* Execute next command from input file on top of stack */
+static void run_next()
+{
+    if (buf_stack->prog) {
+        run_insn();
+        return;
+    }
+
+    char *cmdline = readline();
+    if (cmdline)
+        interpret_cmd(cmdline);
+}
+
+/* Append w to program file as varint.  Return number of bytes written */
+static size_t write_word(FILE *out, uint32_t w)
+{
+    size_t n = 0;
+    do {
+        uint8_t byte = w & 0x7f;
+        w >>= 7;
+        putc(w ? byte | 0x80 : byte, out);
+        n++;
+    } while (w);
+    return n;
+}
+
+bool compile_file(char *src, char *dst)
+{
+    int fd = open(src, O_RDONLY);
+    if (fd < 0) {
+        report(1, "Could not open source file '%s'", src);
+        return false;
+    }
+
+    struct stat st;
+    char *map = NULL;
+    size_t len = 0;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        report(1, "Cannot compile '%s', not a regular file", src);
+        close(fd);
+        return false;
+    }
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            report(1, "Could not map source file '%s'", src);
+            close(fd);
+            return false;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        len = st.st_size;
+    }
+
+    FILE *out = fopen(dst, "wb");
+    if (!out) {
+        report(1, "Could not open program file '%s'", dst);
+        if (map)
+            munmap(map, len);
+        close(fd);
+        return false;
+    }
+
+    prog_header_t h = {.version = PROG_VERSION};
+    memcpy(h.magic, PROG_MAGIC, sizeof(h.magic));
+    bool ok = fwrite(&h, sizeof(h), 1, out) == 1;
+
+    /* Interned strings, mapped to their index plus one */
+    name_table_t interned = {0};
+    char **strs = NULL;
+    int strs_cap = 0;
+    char line[RIO_BUFSIZE];
+    char **args = NULL;
+    int args_cap = 0;
+    size_t insn_cnt = 0;
+
+    for (size_t pos = 0; ok && pos < len;) {
+        bool nl;
+        pos += copy_line(line, map + pos, len - pos, &nl);
+        int argc = split_args(line, &args, &args_cap);
+        if (argc == 0)
+            continue;
+
+        h.code_bytes += write_word(out, argc);
+        for (int i = 0; i < argc; i++) {
+            uintptr_t idx = (uintptr_t) table_find(&interned, args[i]);
+            if (!idx) {
+                argv_reserve(&strs, &strs_cap, h.str_cnt + 1);
+                strs[h.str_cnt] = strsave_or_fail(args[i], "compile_file");
+                h.str_bytes += strlen(args[i]) + 1;
+                idx = ++h.str_cnt;
+                table_add(&interned, strs[idx - 1], (void *) idx);
+            }
+            h.code_bytes += write_word(out, idx - 1);
+        }
+        insn_cnt++;
+        ok = !ferror(out);
+    }
+
+    for (uint32_t i = 0; i < h.str_cnt; i++) {
+        ok = ok && fwrite(strs[i], strlen(strs[i]) + 1, 1, out) == 1;
+        free_string(strs[i]);
+    }
+    ok = ok && !fseek(out, 0, SEEK_SET);
+    ok = ok && fwrite(&h, sizeof(h), 1, out) == 1;
+    ok = !fclose(out) && ok;
+
+    table_free(&interned);
+    if (strs_cap)
+        free_array(strs, strs_cap, sizeof(char *));
+    if (args_cap)
+        free_array(args, args_cap, sizeof(char *));
+    if (map)
+        munmap(map, len);
+    close(fd);
+
+    if (!ok) {
+        report(1, "Error writing program file '%s'", dst);
+        return false;
+    }
+    report(1, "Compiled %zu commands with %u distinct strings into '%s'",
+           insn_cnt, h.str_cnt, dst);
+    return true;
+}
+
+static bool cmd_done()
+{
+    return !buf_stack || quit_flag;
 }
 
 bool finish_cmd()
 {
     bool ok = true;
+    if (loop_open) {
+        report(1, "Missing '}' at end of input");
+        loop_discard();
+        err_cnt++;
+    }
     if (!quit_flag)
         ok = ok && do_quit(0, NULL);
-    has_infile = false;
+    if (argv_cap)
+        free_array(argv_buf, argv_cap, sizeof(char *));
+    argv_buf = NULL;
+    argv_cap = 0;
     return ok && err_cnt == 0;
 }
 
@@ -643,42 +1505,301 @@ void completion(const char *buf, linenoiseCompletions *lc)
     }
 }
 
-bool run_console(char *infile_name, int *tinyweb_fd, int *tinyweb_conn_fd)
+/* Watch fd for input on behalf of src.  Return true if successful */
+static bool ev_watch(ev_src_t *src, int fd)
+{
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = src};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        return false;
+    src->fd = fd;
+    return true;
+}
+
+static void ev_unwatch(ev_src_t *src)
+{
+    if (src->fd >= 0)
+        epoll_ctl(epfd, EPOLL_CTL_DEL, src->fd, NULL);
+    src->fd = -1;
+}
+
+static void input_unwatch()
+{
+    ev_unwatch(&input_src);
+}
+
+/*
+ * Make fd the watched command input.  Return false if it cannot be
+ * watched, as with regular files, which never block anyway.
+ */
+static bool input_watch(int fd)
+{
+    if (input_src.fd == fd)
+        return true;
+    input_unwatch();
+    return ev_watch(&input_src, fd);
+}
+
+/* Run line read from the terminal */
+static void run_line(char *cmdline)
+{
+    /* Before the line is split up in place */
+    linenoiseHistoryAdd(cmdline); /* Add to the history. */
+    interpret_cmd(cmdline);
+    linenoiseHistorySave(HISTORY_FILE); /* Save the history on disk. */
+    linenoiseFree(cmdline);
+}
+
+/* Command input became readable */
+static void input_event()
+{
+    if (input_src.fd != buf_stack->fd)
+        return;
+    if (buf_stack->fd != STDIN_FILENO) {
+        run_next();
+        return;
+    }
+    if (!editing)
+        return;
+
+    char *cmdline = linenoiseEditFeed(&edit_state);
+    if (cmdline == linenoiseEditMore)
+        return;
+    editing = false;
+    linenoiseEditStop(&edit_state);
+    if (!cmdline) {
+        /* ctrl-c, or ctrl-d on empty line, ends terminal input */
+        pop_file();
+        return;
+    }
+    run_line(cmdline);
+}
+
+static void web_close(web_conn_t *conn)
+{
+    web_conn_t **p = &web_conns;
+    while (*p != conn)
+        p = &(*p)->next;
+    *p = conn->next;
+
+    int fd = conn->src.fd;
+    ev_unwatch(&conn->src);
+    close(fd);
+    free_block(conn, sizeof(web_conn_t));
+}
+
+/* Accept every pending connection */
+static void web_accept()
+{
+    int fd;
+    while ((fd = tinyweb_accept(listen_src.fd)) >= 0) {
+        web_conn_t *conn = malloc_or_fail(sizeof(web_conn_t), "web_accept");
+        conn->src.kind = SRC_CONN;
+        conn->tick = web_tick;
+        conn->len = 0;
+        if (!ev_watch(&conn->src, fd)) {
+            close(fd);
+            free_block(conn, sizeof(web_conn_t));
+            continue;
+        }
+        conn->next = web_conns;
+        web_conns = conn;
+    }
+}
+
+/*
+ * Run command named by the path of a web request, then close the
+ * connection.  Unlike typed lines, these do not go into the history, where
+ * the line being edited keeps its place.
+ */
+static void web_run(web_conn_t *conn, char *cmdline)
+{
+    static const char header[] =
+        "HTTP/1.1 200 OK\r\nContent-Type: text/plain; charset=UTF-8\r\n\r\n";
+
+    if (editing && !edit_hidden) {
+        linenoiseHide(&edit_state);
+        edit_hidden = true;
+    }
+    printf("web input: %s\n", cmdline);
+    // replace / to ' ', simulate command line input
+    for (char *c = cmdline; (c = strchr(c, '/'));)
+        *c++ = ' ';
+    if (write(conn->src.fd, header, sizeof(header) - 1) < 0)
+        printf("write web output error.\n");
+    interpret_cmd(cmdline);
+    web_close(conn);
+
+    /* Commands sourced from the request run before editing resumes */
+    if (editing && !cmd_done() && buf_stack->fd == STDIN_FILENO) {
+        fflush(stdout);
+        linenoiseShow(&edit_state);
+        edit_hidden = false;
+    }
+}
+
+/* Read more of a request, and run it once its headers are complete */
+static void web_read(web_conn_t *conn)
+{
+    ssize_t n = read(conn->src.fd, conn->req + conn->len,
+                     WEB_REQ_MAX - 1 - conn->len);
+    if (n < 0 && errno == EAGAIN)
+        return;
+    if (n <= 0) {
+        web_close(conn);
+        return;
+    }
+
+    conn->len += n;
+    conn->req[conn->len] = '\0';
+    conn->tick = web_tick;
+    http_request req;
+    if (tinyweb_parse(conn->req, &req))
+        web_run(conn, req.filename);
+    else if (conn->len == WEB_REQ_MAX - 1)
+        web_close(conn); /* Request is too large */
+}
+
+/* Close connections left idle too long */
+static void web_sweep()
+{
+    uint64_t ticks;
+    if (read(timer_src.fd, &ticks, sizeof(ticks)) == sizeof(ticks))
+        web_tick += ticks;
+
+    web_conn_t *next;
+    for (web_conn_t *conn = web_conns; conn; conn = next) {
+        next = conn->next;
+        if (web_tick - conn->tick >= WEB_IDLE_TICKS)
+            web_close(conn);
+    }
+}
+
+/* Start watching the listener, and a timer, once the web command opens it */
+static void web_update()
+{
+    if (!web_fd || *web_fd <= 0 || listen_src.fd == *web_fd)
+        return;
+    ev_unwatch(&listen_src);
+    if (!ev_watch(&listen_src, *web_fd))
+        return;
+
+    if (timer_src.fd < 0) {
+        struct itimerspec its = {.it_interval = {1, 0}, .it_value = {1, 0}};
+        int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd >= 0 && (timerfd_settime(fd, 0, &its, NULL) < 0 ||
+                        !ev_watch(&timer_src, fd)))
+            close(fd);
+    }
+}
+
+/*
+ * Wait up to timeout milliseconds, or forever when -1, and handle the events
+ * that arrive.  Idle connections are swept after the other events, so none
+ * of them refers to a closed connection.
+ */
+#define EV_BATCH 16
+static void ev_dispatch(int timeout)
+{
+    struct epoll_event evs[EV_BATCH];
+    int n = epoll_wait(epfd, evs, EV_BATCH, timeout);
+    bool sweep = false;
+
+    for (int i = 0; i < n && !cmd_done(); i++) {
+        ev_src_t *src = evs[i].data.ptr;
+        switch (src->kind) {
+        case SRC_INPUT:
+            input_event();
+            break;
+        case SRC_LISTEN:
+            web_accept();
+            break;
+        case SRC_CONN:
+            web_read((web_conn_t *) src);
+            break;
+        case SRC_TIMER:
+            sweep = true;
+            break;
+        }
+    }
+    if (sweep)
+        web_sweep();
+}
+
+/* Read next line from standard input, or begin editing it at a terminal */
+static void run_stdin(bool web)
+{
+    /* The prompt is written straight to the terminal */
+    report_flush();
+    if (editing) {
+        if (edit_hidden) {
+            linenoiseShow(&edit_state);
+            edit_hidden = false;
+        }
+    } else if (linenoiseEditStart(&edit_state, STDIN_FILENO, STDOUT_FILENO,
+                                  edit_buf, sizeof(edit_buf), prompt) < 0) {
+        /* Not a terminal, so lines are read in blocking fashion */
+        char *cmdline = linenoise(prompt);
+        if (cmdline)
+            run_line(cmdline);
+        else
+            pop_file();
+        if (web)
+            ev_dispatch(0);
+        return;
+    } else {
+        editing = true;
+    }
+
+    if (input_watch(STDIN_FILENO))
+        ev_dispatch(-1);
+}
+
+bool run_console(char *infile_name, int *tinyweb_fd)
 {
     if (!push_file(infile_name)) {
         report(1, "ERROR: Could not open source file '%s'", infile_name);
         return false;
     }
 
-    if (!has_infile) {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        report(1, "ERROR: Could not create event loop");
+        pop_file();
+        return false;
+    }
+    web_fd = tinyweb_fd;
+    if (!infile_name)
         linenoiseHistoryLoad(HISTORY_FILE);
-        char *cmdline;
-        while ((cmdline = linenoise(prompt, *tinyweb_fd, tinyweb_conn_fd)) !=
-               NULL) {
-            if (*tinyweb_conn_fd) {
-                char header[] =
-                    "HTTP/1.1 200 OK\r\nContent-Type: text/plain; "
-                    "charset=UTF-8\r\n\r\n";
-                if (write(*tinyweb_conn_fd, header, strlen(header)) < 0)
-                    printf("write web output error.");
-            }
-            interpret_cmd(cmdline);
-            if (*tinyweb_conn_fd) {
-                fsync(*tinyweb_conn_fd);
-                close(*tinyweb_conn_fd);
-                *tinyweb_conn_fd = 0;
-            }
-            linenoiseHistoryAdd(cmdline);       /* Add to the history. */
-            linenoiseHistorySave(HISTORY_FILE); /* Save the history on disk. */
-            linenoiseFree(cmdline);
-            while (buf_stack->fd != STDIN_FILENO)
-                cmd_select(0, NULL, NULL, NULL, NULL);
-            has_infile = false;
+
+    while (!cmd_done()) {
+        web_update();
+        bool web = listen_src.fd >= 0;
+        if (buf_stack->fd == STDIN_FILENO) {
+            run_stdin(web);
+        } else if (buf_stack->map || buf_stack->cnt > 0 ||
+                   !input_watch(buf_stack->fd)) {
+            /* Input is at hand, so only poll the other sources */
+            run_next();
+            if (web)
+                ev_dispatch(0);
+        } else {
+            ev_dispatch(-1);
         }
-    } else {
-        while (!cmd_done())
-            cmd_select(0, NULL, NULL, NULL, NULL);
     }
 
+    /* Quitting from a web request leaves the line being edited hidden */
+    editing = edit_hidden = false;
+    while (web_conns)
+        web_close(web_conns);
+    ev_unwatch(&listen_src);
+    if (timer_src.fd >= 0) {
+        int fd = timer_src.fd;
+        ev_unwatch(&timer_src);
+        close(fd);
+    }
+    input_unwatch();
+    close(epfd);
+    epfd = -1;
+
     return err_cnt == 0;
 }
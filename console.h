@@ -1,7 +1,6 @@
 #ifndef LAB0_CONSOLE_H
 #define LAB0_CONSOLE_H
 #include <stdbool.h>
-#include <sys/select.h>
 #include "linenoise.h"
 #define HISTORY_FILE ".cmd_history"
 
@@ -21,6 +20,10 @@ struct CELE {
     char *name;
     cmd_function operation;
     char *documentation;
+    /* Most bytes held by the code under test while command ran */
+    size_t mem_peak;
+    /* Latencies of command, or NULL until it first runs */
+    struct LAT_HIST *lat;
     cmd_ptr next;
 };
 
@@ -45,6 +48,15 @@ void init_cmd();
 void add_cmd(char *name, cmd_function operation, char *documentation);
 #define ADD_COMMAND(cmd, msg) add_cmd(#cmd, do_##cmd, msg)
 
+/*
+ * Show the most bytes the code under test held at once while each command
+ * ran, for commands that ran with any held
+ */
+void report_cmd_mem(int vlevel);
+
+/* Write latencies of commands to file_name as JSON when quitting */
+void set_stats_file(char *file_name);
+
 /* Add a new parameter */
 void add_param(char *name,
                int *valp,
@@ -66,18 +78,17 @@ void set_echo(bool on);
 bool finish_cmd();
 
 /*
- * Handle command processing in program that uses select as main
- * control loop.
+ * Compile command file src into program file dst, which source and -f then
+ * run without parsing.  Return true if successful.
  */
-int cmd_select(int nfds,
-               fd_set *readfds,
-               fd_set *writefds,
-               fd_set *exceptfds,
-               struct timeval *timeout);
+bool compile_file(char *src, char *dst);
 
-/* Run command loop.  Non-null infile_name implies read commands from that file
+/*
+ * Run command loop.  Non-null infile_name implies read commands from that
+ * file.  Requests reaching the listener in *tinyweb_fd, once the web command
+ * opens it, run as commands too.
  */
-bool run_console(char *infile_name, int *tinyweb_fd, int *tinyweb_conn_fd);
+bool run_console(char *infile_name, int *tinyweb_fd);
 
 /* Callback function to complete command by linenoise */
 void completion(const char *buf, linenoiseCompletions *lc);
@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cqueue.h"
+#include "harness.h"
+
+/* Initial capacity of node pool and string arena */
+#define CQ_INIT_NODES 64
+#define CQ_INIT_ARENA 512
+
+/* Largest index or offset that fits in the 32-bit fields */
+#define CQ_MAX UINT32_MAX
+
+/*
+ * Create empty queue.
+ * Return NULL if could not allocate space.
+ */
+cqueue_t *cq_new()
+{
+    cqueue_t *q = malloc(sizeof(cqueue_t));
+    if (!q)
+        return NULL;
+    q->nodes = malloc(sizeof(cq_node_t) * CQ_INIT_NODES);
+    q->arena = malloc(CQ_INIT_ARENA);
+    if (!q->nodes || !q->arena) {
+        free(q->nodes);
+        free(q->arena);
+        free(q);
+        return NULL;
+    }
+    q->node_cap = CQ_INIT_NODES;
+    q->node_used = 1;
+    q->free_node = 0;
+    q->nodes[0].prev = q->nodes[0].next = 0;
+    q->arena_len = 0;
+    q->arena_cap = CQ_INIT_ARENA;
+    q->garbage = 0;
+    q->count = 0;
+    return q;
+}
+
+/* Free all storage used by queue */
+void cq_free(cqueue_t *q)
+{
+    if (q) {
+        free(q->nodes);
+        free(q->arena);
+        free(q);
+    }
+}
+
+/*
+ * Copy live strings to a fresh arena in list order, dropping garbage.
+ * Return false if could not allocate space.
+ */
+static bool cq_repack(cqueue_t *q, size_t need)
+{
+    size_t cap = q->arena_cap;
+    while (cap < need)
+        cap *= 2;
+    if (cap > CQ_MAX)
+        cap = CQ_MAX;
+    if (cap < need)
+        return false;
+
+    char *arena = malloc(cap);
+    if (!arena)
+        return false;
+    uint32_t len = 0, idx;
+    cq_for_each (idx, q) {
+        size_t n = strlen(cq_value(q, idx)) + 1;
+        memcpy(arena + len, cq_value(q, idx), n);
+        q->nodes[idx].value = len;
+        len += n;
+    }
+    free(q->arena);
+    q->arena = arena;
+    q->arena_len = len;
+    q->arena_cap = cap;
+    q->garbage = 0;
+    return true;
+}
+
+/*
+ * Take a node from the pool and copy s into the arena.
+ * Return 0 if could not allocate space.
+ */
+static uint32_t cq_alloc(cqueue_t *q, const char *s)
+{
+    size_t n = strlen(s) + 1;
+    if ((size_t) q->arena_len + n > q->arena_cap) {
+        /* Reuse garbage first when it makes up half of the arena */
+        size_t need = (size_t) q->arena_len - q->garbage + n;
+        if (q->garbage < q->arena_len / 2)
+            need = (size_t) q->arena_len + n;
+        if (!cq_repack(q, need))
+            return 0;
+    }
+
+    uint32_t idx = q->free_node;
+    if (idx) {
+        q->free_node = q->nodes[idx].next;
+    } else {
+        if (q->node_used == q->node_cap) {
+            if (q->node_cap > CQ_MAX / 2)
+                return 0;
+            cq_node_t *nodes =
+                realloc(q->nodes, sizeof(cq_node_t) * q->node_cap * 2);
+            if (!nodes)
+                return 0;
+            q->nodes = nodes;
+            q->node_cap *= 2;
+        }
+        idx = q->node_used++;
+    }
+
+    memcpy(q->arena + q->arena_len, s, n);
+    q->nodes[idx].value = q->arena_len;
+    q->arena_len += n;
+    q->count++;
+    return idx;
+}
+
+/* Unlink node idx and return it to the pool */
+static void cq_release(cqueue_t *q, uint32_t idx)
+{
+    cq_node_t *node = &q->nodes[idx];
+    q->nodes[node->prev].next = node->next;
+    q->nodes[node->next].prev = node->prev;
+    q->garbage += strlen(cq_value(q, idx)) + 1;
+    node->next = q->free_node;
+    q->free_node = idx;
+    q->count--;
+}
+
+/* Link node idx between prev and next */
+static void cq_link(cqueue_t *q, uint32_t idx, uint32_t prev, uint32_t next)
+{
+    q->nodes[idx].prev = prev;
+    q->nodes[idx].next = next;
+    q->nodes[prev].next = idx;
+    q->nodes[next].prev = idx;
+}
+
+/*
+ * Attempt to insert element at head of queue.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space.
+ */
+bool cq_insert_head(cqueue_t *q, const char *s)
+{
+    if (!q || !s)
+        return false;
+    uint32_t idx = cq_alloc(q, s);
+    if (!idx)
+        return false;
+    cq_link(q, idx, 0, q->nodes[0].next);
+    return true;
+}
+
+/*
+ * Attempt to insert element at tail of queue.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space.
+ */
+bool cq_insert_tail(cqueue_t *q, const char *s)
+{
+    if (!q || !s)
+        return false;
+    uint32_t idx = cq_alloc(q, s);
+    if (!idx)
+        return false;
+    cq_link(q, idx, q->nodes[0].prev, 0);
+    return true;
+}
+
+static bool cq_remove(cqueue_t *q, uint32_t idx, char *sp, size_t bufsize)
+{
+    if (sp && bufsize) {
+        strncpy(sp, cq_value(q, idx), bufsize - 1);
+        sp[bufsize - 1] = '\0';
+    }
+    cq_release(q, idx);
+    return true;
+}
+
+/*
+ * Attempt to remove element from head of queue.
+ * Return false if queue is NULL or empty.
+ */
+bool cq_remove_head(cqueue_t *q, char *sp, size_t bufsize)
+{
+    if (!q || !q->count)
+        return false;
+    return cq_remove(q, q->nodes[0].next, sp, bufsize);
+}
+
+/*
+ * Attempt to remove element from tail of queue.
+ * Return false if queue is NULL or empty.
+ */
+bool cq_remove_tail(cqueue_t *q, char *sp, size_t bufsize)
+{
+    if (!q || !q->count)
+        return false;
+    return cq_remove(q, q->nodes[0].prev, sp, bufsize);
+}
+
+/*
+ * Return number of elements in queue.
+ * Return 0 if q is NULL or empty
+ */
+int cq_size(cqueue_t *q)
+{
+    return q ? q->count : 0;
+}
+
+/*
+ * Delete the middle node in list.
+ * Return false if list is NULL or empty.
+ */
+bool cq_delete_mid(cqueue_t *q)
+{
+    if (!q || !q->count)
+        return false;
+    uint32_t idx = q->nodes[0].next;
+    for (uint32_t i = 0; i < q->count / 2; i++)
+        idx = q->nodes[idx].next;
+    cq_release(q, idx);
+    return true;
+}
+
+/*
+ * Delete all nodes that have duplicate string.
+ * Like q_delete_dup, only adjacent duplicates are found, so queue is
+ * expected to be sorted.
+ */
+bool cq_delete_dup(cqueue_t *q)
+{
+    if (!q)
+        return false;
+    uint32_t idx = q->nodes[0].next;
+    while (idx) {
+        uint32_t next = q->nodes[idx].next;
+        bool dup = false;
+        while (next && !strcmp(cq_value(q, idx), cq_value(q, next))) {
+            uint32_t after = q->nodes[next].next;
+            cq_release(q, next);
+            next = after;
+            dup = true;
+        }
+        if (dup)
+            cq_release(q, idx);
+        idx = next;
+    }
+    return true;
+}
+
+/* Swap every two adjacent nodes */
+void cq_swap(cqueue_t *q)
+{
+    if (!q)
+        return;
+    uint32_t a = q->nodes[0].next;
+    while (a && q->nodes[a].next) {
+        uint32_t b = q->nodes[a].next;
+        uint32_t prev = q->nodes[a].prev, next = q->nodes[b].next;
+        cq_link(q, b, prev, a);
+        cq_link(q, a, b, next);
+        a = next;
+    }
+}
+
+/* Reverse elements in queue */
+void cq_reverse(cqueue_t *q)
+{
+    if (!q)
+        return;
+    uint32_t idx = 0;
+    do {
+        cq_node_t *node = &q->nodes[idx];
+        uint32_t next = node->next;
+        node->next = node->prev;
+        node->prev = next;
+        idx = next;
+    } while (idx);
+}
+
+/* Merge two sorted chains linked through next, terminated by 0 */
+static uint32_t cq_merge(cqueue_t *q, uint32_t a, uint32_t b)
+{
+    uint32_t head = 0, *tail = &head;
+    while (a && b) {
+        if (strcmp(cq_value(q, a), cq_value(q, b)) <= 0) {
+            *tail = a;
+            a = q->nodes[a].next;
+        } else {
+            *tail = b;
+            b = q->nodes[b].next;
+        }
+        tail = &q->nodes[*tail].next;
+    }
+    *tail = a ? a : b;
+    return head;
+}
+
+/* Sort chain of n nodes starting at first, return new first */
+static uint32_t cq_msort(cqueue_t *q, uint32_t first, uint32_t n)
+{
+    if (n < 2) {
+        if (n)
+            q->nodes[first].next = 0;
+        return first;
+    }
+    /* Locate the right half first, sorting rewrites the next indices */
+    uint32_t mid = first;
+    for (uint32_t i = 0; i < n / 2; i++)
+        mid = q->nodes[mid].next;
+    uint32_t left = cq_msort(q, first, n / 2);
+    uint32_t right = cq_msort(q, mid, n - n / 2);
+    return cq_merge(q, left, right);
+}
+
+/* Sort elements of queue in ascending order */
+void cq_sort(cqueue_t *q)
+{
+    if (!q || q->count < 2)
+        return;
+    uint32_t idx = cq_msort(q, q->nodes[0].next, q->count);
+
+    /* Restore the prev indices and close the circle */
+    uint32_t prev = 0;
+    q->nodes[0].next = idx;
+    for (; idx; prev = idx, idx = q->nodes[idx].next)
+        q->nodes[idx].prev = prev;
+    q->nodes[prev].next = 0;
+    q->nodes[0].prev = prev;
+}
+
+/* Return number of bytes of heap storage held by queue */
+size_t cq_footprint(cqueue_t *q)
+{
+    if (!q)
+        return 0;
+    return sizeof(cqueue_t) + sizeof(cq_node_t) * q->node_cap + q->arena_cap;
+}
@@ -0,0 +1,120 @@
+#ifndef LAB0_CQUEUE_H
+#define LAB0_CQUEUE_H
+
+/*
+ * This program implements a compact variant of the queue for very large
+ * queues.
+ *
+ * Instead of one element_t and one string block per element, nodes are kept
+ * in a single growable pool and linked by 32-bit indices, and strings are
+ * packed back to back in a byte arena. An element thus costs 12 bytes of
+ * links plus its characters, against two heap blocks and three 8-byte
+ * pointers in queue.c.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Node in pool. Index 0 is the sentinel head of the circular list */
+typedef struct {
+    uint32_t prev;
+    uint32_t next;
+    /* Offset of the string in arena */
+    uint32_t value;
+} cq_node_t;
+
+typedef struct {
+    cq_node_t *nodes;
+    uint32_t node_cap;
+    /* Unused nodes chained through next, 0 terminates */
+    uint32_t free_node;
+    /* Number of nodes ever handed out, including the sentinel */
+    uint32_t node_used;
+
+    char *arena;
+    uint32_t arena_len;
+    uint32_t arena_cap;
+    /* Bytes of arena owned by strings of removed elements */
+    uint32_t garbage;
+
+    uint32_t count;
+} cqueue_t;
+
+/* Iterate over pool indices of the elements of q in order */
+#define cq_for_each(idx, q) \
+    for (idx = (q)->nodes[0].next; idx != 0; idx = (q)->nodes[idx].next)
+
+/* String held by the element at pool index idx */
+static inline const char *cq_value(const cqueue_t *q, uint32_t idx)
+{
+    return q->arena + q->nodes[idx].value;
+}
+
+/* Operations on compact queue, with the same meaning as in queue.h */
+
+/*
+ * Create empty queue.
+ * Return NULL if could not allocate space.
+ */
+cqueue_t *cq_new();
+
+/*
+ * Free ALL storage used by queue.
+ * No effect if q is NULL
+ */
+void cq_free(cqueue_t *q);
+
+/*
+ * Attempt to insert element at head or tail of queue.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space.
+ */
+bool cq_insert_head(cqueue_t *q, const char *s);
+bool cq_insert_tail(cqueue_t *q, const char *s);
+
+/*
+ * Attempt to remove element from head or tail of queue.
+ * Return true if successful.
+ * Return false if queue is NULL or empty.
+ * If sp is non-NULL and an element is removed, copy the removed string to *sp
+ * (up to a maximum of bufsize-1 characters, plus a null terminator.)
+ * The element's storage returns to the pool, there is nothing to release.
+ */
+bool cq_remove_head(cqueue_t *q, char *sp, size_t bufsize);
+bool cq_remove_tail(cqueue_t *q, char *sp, size_t bufsize);
+
+/*
+ * Return number of elements in queue.
+ * Return 0 if q is NULL or empty
+ */
+int cq_size(cqueue_t *q);
+
+/*
+ * Delete the middle node in list, see q_delete_mid.
+ * Return false if list is NULL or empty.
+ */
+bool cq_delete_mid(cqueue_t *q);
+
+/*
+ * Delete all nodes that have duplicate string, see q_delete_dup.
+ * Return false if list is NULL.
+ */
+bool cq_delete_dup(cqueue_t *q);
+
+/* Swap every two adjacent nodes */
+void cq_swap(cqueue_t *q);
+
+/* Reverse elements in queue */
+void cq_reverse(cqueue_t *q);
+
+/* Sort elements of queue in ascending order */
+void cq_sort(cqueue_t *q);
+
+/*
+ * Return number of bytes of heap storage held by queue, including unused
+ * capacity of the pool and the arena.
+ */
+size_t cq_footprint(cqueue_t *q);
+
+#endif /* LAB0_CQUEUE_H */
@@ -1,10 +1,17 @@
 /* Test support code */
 
+#define _GNU_SOURCE /* dladdr */
+
+#include <dlfcn.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #include "report.h"
@@ -24,6 +31,9 @@
 /* Value at end of every block */
 #define MAGICFOOTER 0xbeefdead
 
+/* Value at start of block left out of sampling, such block has no footer */
+#define MAGICLIGHT 0xfeedface
+
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
 
@@ -36,47 +46,697 @@
 typedef struct BELE {
     struct BELE *next, *prev;
     size_t payload_size;
-    size_t magic_header; /* Marker to see if block seems legitimate */
+    unsigned int magic_header; /* Marker to see if block seems legitimate */
+    unsigned char site;        /* Index of allocating call site in sites */
+    unsigned char category;    /* Kind of data held, a mem_category_t */
+    unsigned short owner;      /* Index of allocating thread in threads */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_ele_t;
 
-static block_ele_t *allocated = NULL;
-static size_t allocated_count = 0;
+/*
+ * Freed blocks with small payloads are kept poisoned in per-size-class free
+ * lists, chained through next, and handed out again by test_malloc.
+ * Class i holds blocks with room for (i + 1) * CLASS_GRAIN payload bytes.
+ */
+#define CLASS_GRAIN 16
+#define CLASS_COUNT 16
+#define CLASS_LIMIT 4096 /* Most blocks kept per class */
+
+/*
+ * Allocation state of one thread.
+ * Only the thread itself allocates from it and touches its size classes,
+ * but any thread may free one of its blocks while holding lock.
+ */
+typedef struct {
+    /* Guards allocated, allocated_count and the live set */
+    pthread_mutex_t lock;
+    block_ele_t *allocated;
+    size_t allocated_count;
+
+    /*
+     * Open-addressing hash set of allocated blocks, with linear probing.
+     * Lets cautious mode confirm that a block is live in O(1) instead of
+     * walking the allocated list.  Built from the list when cautious mode
+     * first needs it and dropped when cautious mode is turned off, so that
+     * big queues freed unchecked don't pay for keeping it.
+     */
+    block_ele_t **live_set;
+    size_t live_cap; /* Power of 2 */
+    bool live_built; /* Set holds every allocated block */
+
+    /* Unsampled blocks allocated minus those freed by this thread */
+    long light_count;
+
+    block_ele_t *free_class[CLASS_COUNT];
+    size_t free_class_cnt[CLASS_COUNT];
+
+    uint64_t rng;
+    unsigned short id;
+    bool active; /* Attached to a running thread */
+} thread_state_t;
+
+#define LIVE_INIT_CAP 1024
+
+/*
+ * Every thread that ever allocated.  A state outlives its thread, since its
+ * blocks may still be live, and is handed to the next thread to start.
+ */
+#define THREAD_MAX 1024
+static thread_state_t *threads[THREAD_MAX];
+static unsigned int thread_cnt = 0;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t threads_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+static __thread thread_state_t *self = NULL;
+
+/*
+ * Number of harness locks held by this thread.  A timeout arriving while one
+ * is held is put off until the last is released, since jumping out would
+ * leave the lock held and the block list half updated.
+ */
+static __thread volatile sig_atomic_t lock_depth = 0;
+static __thread volatile sig_atomic_t timeout_deferred = 0;
+
+static inline void harness_lock(pthread_mutex_t *m)
+{
+    lock_depth++;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    pthread_mutex_lock(m);
+}
+
+static inline void harness_unlock(pthread_mutex_t *m)
+{
+    pthread_mutex_unlock(m);
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    if (--lock_depth == 0 && timeout_deferred) {
+        /* Deliver the timeout now that it is safe to leave */
+        timeout_deferred = 0;
+        raise(SIGALRM);
+    }
+}
+
+/*
+ * Allocation statistics per call site, found by the return address of
+ * test_malloc and friends in an open-addressing table.
+ * Slot 0 collects the calls made once the table is half full.
+ * Shared by all threads, so counters are only updated atomically.
+ */
+#define SITE_CAP 256 /* Power of 2 */
+typedef struct {
+    void *addr;
+    size_t live_cnt, live_bytes, peak_bytes, total_cnt;
+} site_t;
+static site_t sites[SITE_CAP];
+static size_t site_cnt = 0;
+
+/*
+ * Byte accounting per category of allocation, updated atomically as sites
+ * are.  Overhead counts the header, the footer and the unused room of the
+ * size class, so bytes plus overhead is what the harness took from libc.
+ */
+typedef struct {
+    size_t blocks, bytes, peak_bytes, overhead;
+} mem_stat_t;
+static mem_stat_t mem_stats[MEM_CATEGORIES];
+static size_t mem_bytes = 0, mem_peak_bytes = 0; /* Over all categories */
+static size_t mem_window_bytes = 0; /* Peak since mem_window_start */
+
+/* Most megabytes of payload allowed at once (0 = unlimited) */
+int mem_limit = 0;
+
+/* Blocks of this size taken by test_malloc or test_calloc are nodes */
+static size_t node_size = 0;
+
+/*
+ * Pool of guarded slots for sampled allocations.
+ * Data pages of the slots alternate with PROT_NONE guard pages, and a block
+ * ends flush against the guard page that follows its slot, so the first
+ * byte written past it faults at once.  Freed slots are made inaccessible
+ * as well until reused, which catches use after free.
+ * The header of such block lives in guard_slots instead of before payload.
+ */
+#define GUARD_SLOTS 64
+typedef struct {
+    block_ele_t hdr; /* Size, site and category of the block */
+    void *payload;   /* Block in slot, kept after free to report misuse */
+    bool live;
+} guard_slot_t;
+static guard_slot_t guard_slots[GUARD_SLOTS];
+static char *guard_pool = NULL; /* Guard page of slot 0 comes first */
+static size_t guard_page = 0;
+static size_t guard_next = 0; /* Where to look for a free slot */
+static size_t guard_live = 0;
+static pthread_mutex_t guard_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Calls to test_realloc that kept the block where it was, and those not */
+static size_t realloc_in_place = 0;
+static size_t realloc_moved = 0;
+
+#define ATOMIC_ADD(p, v) __atomic_add_fetch(p, v, __ATOMIC_RELAXED)
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/* Check and poison one in sample_rate allocations (1 or less = all) */
+int sample_rate = 1;
+
+/* Place one in guard_rate allocations against a guard page (0 = none) */
+int guard_rate = 0;
+
 static bool cautious_mode = true;
-static bool noallocate_mode = false;
+static __thread bool noallocate_mode = false;
+static __thread int thread_fail_probability = -1;
 static bool error_occurred = false;
 static char *error_message = "";
 
-static int time_limit = 1;
+/* Seconds a time limited region may run (0 or less = unlimited) */
+int time_limit = 1;
 
 /*
  * Data for managing exceptions
+ * The timer is armed by the first guarded region and then left running.
+ * Later regions only move the deadline, and the SIGALRM handler re-arms
+ * the timer for whatever is left of it, so entering and leaving a region
+ * normally takes no system call.
  */
-static jmp_buf env;
+static sigjmp_buf env;
 static volatile sig_atomic_t jmp_ready = false;
-static bool time_limited = false;
+static volatile sig_atomic_t time_limited = false;
+static volatile sig_atomic_t timer_armed = false;
+static struct timespec deadline;
 
 /*
  * Internal functions
  */
 
+/* xorshift64*, cheap enough to run on every allocation */
+static inline uint64_t next_random(thread_state_t *t)
+{
+    t->rng ^= t->rng >> 12;
+    t->rng ^= t->rng << 25;
+    t->rng ^= t->rng >> 27;
+    return t->rng * 0x2545F4914F6CDD1DULL;
+}
+
 /* Should this allocation fail? */
-static bool fail_allocation()
+static bool fail_allocation(thread_state_t *t)
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    int percent = thread_fail_probability < 0 ? fail_probability
+                                              : thread_fail_probability;
+    if (percent <= 0)
+        return false;
+    double weight = (double) (next_random(t) >> 11) / (1ULL << 53);
+    return (weight < 0.01 * percent);
+}
+
+static bool sample_allocation(thread_state_t *t)
+{
+    if (sample_rate <= 1)
+        return true;
+    return (next_random(t) >> 32) % sample_rate == 0;
+}
+
+static inline size_t class_of(size_t size)
+{
+    return size ? (size - 1) / CLASS_GRAIN : 0;
+}
+
+static inline size_t class_room(size_t size)
+{
+    return class_of(size) < CLASS_COUNT ? (class_of(size) + 1) * CLASS_GRAIN
+                                        : size;
+}
+
+/* Release blocks cached in size classes of t */
+static void cache_flush(thread_state_t *t)
+{
+    for (size_t i = 0; i < CLASS_COUNT; i++) {
+        while (t->free_class[i]) {
+            block_ele_t *b = t->free_class[i];
+            t->free_class[i] = b->next;
+            free(b);
+        }
+        t->free_class_cnt[i] = 0;
+    }
+}
+
+/* Release cached blocks and live sets at exit */
+static void harness_cleanup()
+{
+    if (guard_pool)
+        munmap(guard_pool, (2 * GUARD_SLOTS + 1) * guard_page);
+    guard_pool = NULL;
+    for (unsigned int i = 0; i < thread_cnt; i++) {
+        thread_state_t *t = threads[i];
+        cache_flush(t);
+        free(t->live_set);
+        t->live_set = NULL;
+        t->live_cap = 0;
+        t->live_built = false;
+    }
+}
+
+/* Called as a thread exits, leaving its state to be adopted */
+static void thread_detach(void *arg)
+{
+    thread_state_t *t = arg;
+    cache_flush(t);
+    harness_lock(&threads_lock);
+    t->active = false;
+    harness_unlock(&threads_lock);
+}
+
+static void threads_init()
+{
+    pthread_key_create(&thread_key, thread_detach);
+    atexit(harness_cleanup);
+}
+
+/* Give calling thread a state, reusing one left by an exited thread */
+static thread_state_t *thread_attach()
+{
+    pthread_once(&threads_once, threads_init);
+    harness_lock(&threads_lock);
+    thread_state_t *t = NULL;
+    for (unsigned int i = 0; i < thread_cnt; i++) {
+        if (!threads[i]->active) {
+            t = threads[i];
+            break;
+        }
+    }
+    if (!t && thread_cnt < THREAD_MAX && (t = calloc(1, sizeof(*t)))) {
+        pthread_mutex_init(&t->lock, NULL);
+        t->id = thread_cnt;
+        t->rng = 0x2545F4914F6CDD1DULL + t->id * 0x9E3779B97F4A7C15ULL;
+        threads[thread_cnt] = t;
+        /* Publish the state before find_header may look it up */
+        __atomic_store_n(&thread_cnt, thread_cnt + 1, __ATOMIC_RELEASE);
+    }
+    if (t)
+        t->active = true;
+    harness_unlock(&threads_lock);
+
+    if (!t) {
+        report_event(MSG_FATAL, "Couldn't set up allocation state of thread");
+        return NULL;
+    }
+    pthread_setspecific(thread_key, t);
+    self = t;
+    return t;
+}
+
+static inline thread_state_t *thread_state()
+{
+    return self ? self : thread_attach();
+}
+
+static inline size_t live_slot(thread_state_t *t, block_ele_t *b)
+{
+    /* Fibonacci hashing, high bits are the well mixed ones */
+    uint64_t h = (uint64_t) (uintptr_t) b * 0x9E3779B97F4A7C15ULL;
+    return (size_t) (h >> 32) & (t->live_cap - 1);
+}
+
+/* Return slot holding b, or the empty slot where b would go */
+static size_t live_find(thread_state_t *t, block_ele_t *b)
+{
+    size_t i = live_slot(t, b);
+    while (t->live_set[i] && t->live_set[i] != b)
+        i = (i + 1) & (t->live_cap - 1);
+    return i;
+}
+
+/* Keep load factor at most 1/2.  Return false if could not allocate space */
+static bool live_reserve(thread_state_t *t, size_t cnt)
+{
+    if (!t->live_built || 2 * cnt <= t->live_cap)
+        return true;
+
+    size_t old_cap = t->live_cap;
+    block_ele_t **old_set = t->live_set;
+    size_t cap = old_cap ? 2 * old_cap : LIVE_INIT_CAP;
+    block_ele_t **set = calloc(cap, sizeof(block_ele_t *));
+    if (!set)
+        return false;
+
+    t->live_set = set;
+    t->live_cap = cap;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old_set[i])
+            t->live_set[live_find(t, old_set[i])] = old_set[i];
+    }
+    free(old_set);
+    return true;
+}
+
+static void live_insert(thread_state_t *t, block_ele_t *b)
+{
+    if (t->live_built)
+        t->live_set[live_find(t, b)] = b;
+}
+
+/*
+ * Fill the live set from the allocated list.
+ * Return false if could not allocate space.
+ */
+static bool live_build(thread_state_t *t)
+{
+    size_t cap = t->live_cap ? t->live_cap : LIVE_INIT_CAP;
+    while (cap < 2 * t->allocated_count)
+        cap *= 2;
+    if (cap != t->live_cap) {
+        block_ele_t **set = calloc(cap, sizeof(block_ele_t *));
+        if (!set)
+            return false;
+        free(t->live_set);
+        t->live_set = set;
+        t->live_cap = cap;
+    } else {
+        memset(t->live_set, 0, cap * sizeof(block_ele_t *));
+    }
+
+    t->live_built = true;
+    for (block_ele_t *b = t->allocated; b; b = b->next)
+        live_insert(t, b);
+    return true;
+}
+
+static bool live_contains(thread_state_t *t, block_ele_t *b)
+{
+    if (t->live_built || live_build(t))
+        return t->live_set[live_find(t, b)] == b;
+
+    /* No room for the set, fall back to walking the list */
+    for (block_ele_t *e = t->allocated; e; e = e->next) {
+        if (e == b)
+            return true;
+    }
+    return false;
+}
+
+/* Remove b, shifting back later entries of its probe run */
+static void live_remove(thread_state_t *t, block_ele_t *b)
+{
+    if (!t->live_built)
+        return;
+    block_ele_t **set = t->live_set;
+    size_t mask = t->live_cap - 1;
+    size_t i = live_find(t, b);
+    if (set[i] != b)
+        return;
+    set[i] = NULL;
+    for (size_t j = (i + 1) & mask; set[j]; j = (j + 1) & mask) {
+        size_t k = live_slot(t, set[j]);
+        /* Entry at j may move to i unless its home lies in (i, j] */
+        if (((j - k) & mask) >= ((j - i) & mask)) {
+            set[i] = set[j];
+            set[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+/* Return index of site for return address addr, claiming a slot if new */
+static unsigned int site_index(void *addr)
+{
+    /* Most runs allocate from the same place over and over */
+    static __thread void *last_addr = NULL;
+    static __thread unsigned int last_idx = 0;
+    if (addr == last_addr)
+        return last_idx;
+
+    uint64_t h = (uint64_t) (uintptr_t) addr * 0x9E3779B97F4A7C15ULL;
+    unsigned int i = (h >> 32) & (SITE_CAP - 1);
+    while (true) {
+        void *cur = __atomic_load_n(&sites[i].addr, __ATOMIC_ACQUIRE);
+        if (cur == addr)
+            break;
+        if (!cur && i) {
+            if (2 * __atomic_load_n(&site_cnt, __ATOMIC_RELAXED) >= SITE_CAP) {
+                i = 0;
+                break;
+            }
+            if (__atomic_compare_exchange_n(&sites[i].addr, &cur, addr, false,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                ATOMIC_ADD(&site_cnt, 1);
+                break;
+            }
+            /* Another thread took the slot first, look at it again */
+            continue;
+        }
+        i = (i + 1) & (SITE_CAP - 1);
+    }
+    last_addr = addr;
+    last_idx = i;
+    return i;
+}
+
+/* Raise *peakp to live unless another thread got higher already */
+static inline void raise_peak(size_t *peakp, size_t live)
+{
+    size_t peak = __atomic_load_n(peakp, __ATOMIC_RELAXED);
+    while (live > peak &&
+           !__atomic_compare_exchange_n(peakp, &peak, live, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static inline void site_alloc(block_ele_t *b, void *addr)
+{
+    site_t *s = &sites[b->site = site_index(addr)];
+    ATOMIC_ADD(&s->total_cnt, 1);
+    ATOMIC_ADD(&s->live_cnt, 1);
+    raise_peak(&s->peak_bytes, ATOMIC_ADD(&s->live_bytes, b->payload_size));
+}
+
+/* Account for payload of b having been resized from old_size */
+static inline void site_resize(block_ele_t *b, size_t old_size)
+{
+    site_t *s = &sites[b->site & (SITE_CAP - 1)];
+    raise_peak(&s->peak_bytes,
+               ATOMIC_ADD(&s->live_bytes, b->payload_size - old_size));
+}
+
+/* Bytes taken from libc for b besides its payload */
+static inline size_t block_overhead(block_ele_t *b, bool light)
+{
+    size_t room = light ? b->payload_size : class_room(b->payload_size);
+    return room - b->payload_size + sizeof(block_ele_t) + sizeof(size_t);
+}
+
+static inline void mem_add(block_ele_t *b, bool light)
+{
+    mem_stat_t *m = &mem_stats[b->category];
+    ATOMIC_ADD(&m->blocks, 1);
+    ATOMIC_ADD(&m->overhead, block_overhead(b, light));
+    raise_peak(&m->peak_bytes, ATOMIC_ADD(&m->bytes, b->payload_size));
+    size_t bytes = ATOMIC_ADD(&mem_bytes, b->payload_size);
+    raise_peak(&mem_peak_bytes, bytes);
+    raise_peak(&mem_window_bytes, bytes);
+}
+
+/* Would size more bytes of payload break mem_limit? */
+static inline bool over_limit(size_t size)
+{
+    size_t bytes = __atomic_load_n(&mem_bytes, __ATOMIC_RELAXED);
+    return mem_limit > 0 && bytes + size > (size_t) mem_limit << 20;
+}
+
+static inline void mem_sub(block_ele_t *b, bool light)
+{
+    /* Mask keeps a corrupted header within the table */
+    mem_stat_t *m = &mem_stats[b->category % MEM_CATEGORIES];
+    ATOMIC_ADD(&m->blocks, -1);
+    ATOMIC_ADD(&m->overhead, -block_overhead(b, light));
+    ATOMIC_ADD(&m->bytes, -b->payload_size);
+    ATOMIC_ADD(&mem_bytes, -b->payload_size);
+}
+
+static inline void site_free(block_ele_t *b)
+{
+    /* Mask keeps a corrupted header within the table */
+    site_t *s = &sites[b->site & (SITE_CAP - 1)];
+    ATOMIC_ADD(&s->live_cnt, -1);
+    ATOMIC_ADD(&s->live_bytes, -b->payload_size);
+}
+
+/* Only the owning thread writes light_count, others merely read it */
+static inline void light_add(thread_state_t *t, long n)
+{
+    __atomic_store_n(&t->light_count, t->light_count + n, __ATOMIC_RELAXED);
 }
 
 /*
- * Find header of block, given its payload.
+ * Keep freed block b in a size class of t.
+ * Return false if class is full or b is too large, in which case the caller
+ * releases it.
+ */
+static bool cache_put(thread_state_t *t, block_ele_t *b)
+{
+    size_t c = class_of(b->payload_size);
+    if (c >= CLASS_COUNT || t->free_class_cnt[c] >= CLASS_LIMIT)
+        return false;
+    b->next = t->free_class[c];
+    t->free_class[c] = b;
+    t->free_class_cnt[c]++;
+    return true;
+}
+
+/*
+ * Take a cached block of t with room for size bytes, or NULL if there is
+ * none.  The poison written by test_free must still be intact, otherwise the
+ * block was written to after being freed.
+ */
+static block_ele_t *cache_get(thread_state_t *t, size_t size)
+{
+    size_t c = class_of(size);
+    if (c >= CLASS_COUNT || !t->free_class[c])
+        return NULL;
+    block_ele_t *b = t->free_class[c];
+    t->free_class[c] = b->next;
+    t->free_class_cnt[c]--;
+
+    unsigned char *p = b->payload;
+    size_t i = 0;
+    while (i < b->payload_size && p[i] == FILLCHAR)
+        i++;
+    if (b->magic_header != MAGICFREE || i != b->payload_size ||
+        *(size_t *) (p + b->payload_size) != MAGICFREE) {
+        report_event(MSG_ERROR,
+                     "Block with address %p was modified after being freed",
+                     (void *) p);
+        error_occurred = true;
+    }
+    return b;
+}
+
+/* Describe code address addr as symbol+offset, or module+offset */
+static void site_name(void *addr, char *buf, size_t len)
+{
+    Dl_info info;
+    if (!addr) {
+        snprintf(buf, len, "(other sites)");
+    } else if (!dladdr(addr, &info) || !info.dli_fname) {
+        snprintf(buf, len, "%p", addr);
+    } else if (info.dli_sname) {
+        snprintf(buf, len, "%s+0x%lx", info.dli_sname,
+                 (unsigned long) ((char *) addr - (char *) info.dli_saddr));
+    } else {
+        /* Static function, feed offset to addr2line -f -e <module> */
+        const char *name = strrchr(info.dli_fname, '/');
+        snprintf(buf, len, "%s+0x%lx", name ? name + 1 : info.dli_fname,
+                 (unsigned long) ((char *) addr - (char *) info.dli_fbase));
+    }
+}
+
+static inline char *guard_data(size_t slot)
+{
+    return guard_pool + (2 * slot + 1) * guard_page;
+}
+
+/* Return slot of block p if p points into the pool, else -1 */
+static inline long guard_slot_of(void *p)
+{
+    char *pool = __atomic_load_n(&guard_pool, __ATOMIC_ACQUIRE);
+    if (!pool || (char *) p < pool ||
+        (char *) p >= pool + (2 * GUARD_SLOTS + 1) * guard_page)
+        return -1;
+    return ((char *) p - pool) / guard_page / 2;
+}
+
+/* Map the pool on first use.  Return false if could not */
+static bool guard_init()
+{
+    if (guard_pool)
+        return true;
+    size_t page = sysconf(_SC_PAGESIZE);
+    char *pool = mmap(NULL, (2 * GUARD_SLOTS + 1) * page, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED)
+        return false;
+    guard_page = page;
+    __atomic_store_n(&guard_pool, pool, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * Place block of size bytes in a free slot.
+ * Return NULL if size is 0 or exceeds a page, or if no slot is free.
+ * An empty block would start at the guard page, outside its own slot.
+ */
+static void *guard_alloc(thread_state_t *t,
+                         size_t size,
+                         mem_category_t cat,
+                         void *site)
+{
+    /* Cheap way out while every slot is taken */
+    if (__atomic_load_n(&guard_live, __ATOMIC_RELAXED) >= GUARD_SLOTS)
+        return NULL;
+
+    harness_lock(&guard_lock);
+    if (!guard_init() || !size || size > guard_page) {
+        harness_unlock(&guard_lock);
+        return NULL;
+    }
+    size_t slot = guard_next, n = 0;
+    while (guard_slots[slot].live && n++ < GUARD_SLOTS)
+        slot = (slot + 1) % GUARD_SLOTS;
+    char *data = guard_data(slot);
+    if (guard_slots[slot].live ||
+        mprotect(data, guard_page, PROT_READ | PROT_WRITE)) {
+        harness_unlock(&guard_lock);
+        return NULL;
+    }
+    guard_next = (slot + 1) % GUARD_SLOTS;
+
+    /* Keep the largest alignment that size allows, up to 16 */
+    size_t align = 16;
+    while (align > 1 && size % align)
+        align /= 2;
+    char *p = (char *) ((uintptr_t) (data + guard_page - size) & ~(align - 1));
+    memset(p, FILLCHAR, size);
+
+    guard_slot_t *g = &guard_slots[slot];
+    g->payload = p;
+    g->live = true;
+    g->hdr.payload_size = size;
+    g->hdr.owner = t->id;
+    g->hdr.category = cat;
+    site_alloc(&g->hdr, site);
+    mem_add(&g->hdr, true);
+    ATOMIC_ADD(&guard_live, 1);
+    harness_unlock(&guard_lock);
+    return p;
+}
+
+/* Free block p of slot, revoking access to its page */
+static void guard_free(long slot, void *p)
+{
+    harness_lock(&guard_lock);
+    guard_slot_t *g = &guard_slots[slot];
+    if (!g->live || g->payload != p) {
+        harness_unlock(&guard_lock);
+        report_event(MSG_ERROR,
+                     "Attempted to free unallocated block.  Address = %p", p);
+        error_occurred = true;
+        return;
+    }
+    mprotect(guard_data(slot), guard_page, PROT_NONE);
+    site_free(&g->hdr);
+    mem_sub(&g->hdr, true);
+    g->live = false;
+    ATOMIC_ADD(&guard_live, -1);
+    harness_unlock(&guard_lock);
+}
+
+/*
+ * Find header of block, given its payload, and lock the state of the thread
+ * that allocated it.  The caller must unlock *ownerp when it is not NULL.
  * Signal error if doesn't seem like legitimate block
  */
-static block_ele_t *find_header(void *p)
+static block_ele_t *find_header(void *p, thread_state_t **ownerp)
 {
     if (!p) {
         report_event(MSG_ERROR, "Attempting to free null block");
@@ -84,15 +744,17 @@ static block_ele_t *find_header(void *p)
     }
 
     block_ele_t *b = (block_ele_t *) ((size_t) p - sizeof(block_ele_t));
+    unsigned int owner = b->owner;
+    thread_state_t *t = NULL;
+    if (owner < __atomic_load_n(&thread_cnt, __ATOMIC_ACQUIRE)) {
+        t = threads[owner];
+        harness_lock(&t->lock);
+    }
+    *ownerp = t;
+
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
-        block_ele_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
+        if (!t || !live_contains(t, b)) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
@@ -100,7 +762,7 @@ static block_ele_t *find_header(void *p)
         }
     }
 
-    if (b->magic_header != MAGICHEADER) {
+    if (!t || b->magic_header != MAGICHEADER) {
         report_event(
             MSG_ERROR,
             "Attempted to free unallocated or corrupted block.  Address = %p",
@@ -122,45 +784,96 @@ static size_t *find_footer(block_ele_t *b)
 /*
  * Implementation of application functions
  */
-void *test_malloc(size_t size)
+
+/*
+ * Allocate checked block of size bytes holding data of category cat on
+ * behalf of the caller at site
+ */
+static void *alloc_block(size_t size, mem_category_t cat, void *site)
 {
     if (noallocate_mode) {
         report_event(MSG_FATAL, "Calls to malloc disallowed");
         return NULL;
     }
 
-    if (fail_allocation()) {
+    thread_state_t *t = thread_state();
+    if (!t)
+        return NULL;
+
+    if (fail_allocation(t)) {
         report_event(MSG_WARN, "Malloc returning NULL");
         return NULL;
     }
 
-    block_ele_t *new_block =
-        malloc(size + sizeof(block_ele_t) + sizeof(size_t));
+    if (over_limit(size)) {
+        report_event(MSG_WARN,
+                     "Malloc returning NULL, memory limit of %d megabytes "
+                     "reached",
+                     mem_limit);
+        return NULL;
+    }
+
+    if (guard_rate > 0 && next_random(t) % guard_rate == 0) {
+        void *p = guard_alloc(t, size, cat, site);
+        if (p)
+            return p;
+    }
+
+    bool sampled = sample_allocation(t);
+    block_ele_t *new_block = sampled ? cache_get(t, size) : NULL;
+    /* Checked blocks get the room of their class so they can be reused */
+    if (!new_block)
+        new_block = malloc((sampled ? class_room(size) : size) +
+                           sizeof(block_ele_t) + sizeof(size_t));
     if (!new_block) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
+        return NULL;
     }
 
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->magic_header = MAGICHEADER;
-    // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
-    *find_footer(new_block) = MAGICFOOTER;
+    new_block->owner = t->id;
+    new_block->category = cat;
+    site_alloc(new_block, site);
+    mem_add(new_block, !sampled);
     void *p = (void *) &new_block->payload;
+
+    if (!sampled) {
+        /* Only counted, so that leak checks stay exact */
+        new_block->magic_header = MAGICLIGHT;
+        light_add(t, 1);
+        return p;
+    }
+
+    new_block->magic_header = MAGICHEADER;
+    *find_footer(new_block) = MAGICFOOTER;
     memset(p, FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
 
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+    harness_lock(&t->lock);
+    if (!live_reserve(t, t->allocated_count + 1)) {
+        harness_unlock(&t->lock);
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+        return NULL;
+    }
+    new_block->next = t->allocated;
+    new_block->prev = NULL;
+    if (t->allocated)
+        t->allocated->prev = new_block;
+    t->allocated = new_block;
+    t->allocated_count++;
+    live_insert(t, new_block);
+    harness_unlock(&t->lock);
 
     return p;
 }
 
+void *test_malloc(size_t size)
+{
+    return alloc_block(size, size == node_size ? MEM_NODE : MEM_OTHER,
+                       __builtin_return_address(0));
+}
+
 // cppcheck-suppress unusedFunction
 void *test_calloc(size_t nelem, size_t elsize)
 {
@@ -168,8 +881,10 @@ void *test_calloc(size_t nelem, size_t elsize)
      * https://danluu.com/malloc-tutorial/
      */
     size_t size = nelem * elsize;  // TODO: check for overflow
-    void *ptr = test_malloc(size);
-    memset(ptr, 0, size);
+    void *ptr = alloc_block(size, size == node_size ? MEM_NODE : MEM_OTHER,
+                            __builtin_return_address(0));
+    if (ptr)
+        memset(ptr, 0, size);
     return ptr;
 }
 
@@ -183,7 +898,35 @@ void test_free(void *p)
     if (!p)
         return;
 
-    block_ele_t *b = find_header(p);
+    thread_state_t *self_state = thread_state();
+    if (!self_state)
+        return;
+
+    long slot = guard_slot_of(p);
+    if (slot >= 0) {
+        guard_free(slot, p);
+        return;
+    }
+
+    block_ele_t *b = (block_ele_t *) ((size_t) p - sizeof(block_ele_t));
+    if (b->magic_header == MAGICLIGHT) {
+        site_free(b);
+        mem_sub(b, true);
+        b->magic_header = MAGICFREE;
+        free(b);
+        light_add(self_state, -1);
+        return;
+    }
+
+    thread_state_t *t;
+    b = find_header(p, &t);
+    if (!t)
+        return;
+    if (b->magic_header == MAGICFREE) {
+        /* Freed already, perhaps still sitting in a size class */
+        harness_unlock(&t->lock);
+        return;
+    }
     size_t footer = *find_footer(b);
     if (footer != MAGICFOOTER) {
         report_event(MSG_ERROR,
@@ -192,9 +935,6 @@ void test_free(void *p)
                      p);
         error_occurred = true;
     }
-    b->magic_header = MAGICFREE;
-    *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
 
     /* Unlink from list */
     block_ele_t *bn = b->next;
@@ -202,19 +942,145 @@ void test_free(void *p)
     if (bp)
         bp->next = bn;
     else
-        allocated = bn;
+        t->allocated = bn;
     if (bn)
         bn->prev = bp;
+    live_remove(t, b);
+    t->allocated_count--;
+    b->magic_header = MAGICFREE;
+    harness_unlock(&t->lock);
+
+    *find_footer(b) = MAGICFREE;
+    memset(p, FILLCHAR, b->payload_size);
+    site_free(b);
+    mem_sub(b, false);
+    if (!cache_put(self_state, b))
+        free(b);
+}
+
+// cppcheck-suppress unusedFunction
+void *test_realloc(void *p, size_t size)
+{
+    void *site = __builtin_return_address(0);
+    if (!p)
+        return alloc_block(size, MEM_OTHER, site);
+    if (!size) {
+        test_free(p);
+        return NULL;
+    }
+
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to realloc disallowed");
+        return NULL;
+    }
+
+    thread_state_t *self_state = thread_state();
+    if (!self_state)
+        return NULL;
+
+    if (fail_allocation(self_state)) {
+        report_event(MSG_WARN, "Realloc returning NULL");
+        return NULL;
+    }
+
+    long slot = guard_slot_of(p);
+    if (slot >= 0) {
+        /* Guarded block cannot grow, always move it out */
+        guard_slot_t *g = &guard_slots[slot];
+        size_t old_size = g->live && g->payload == p ? g->hdr.payload_size : 0;
+        void *np = alloc_block(size, g->hdr.category, site);
+        if (!np)
+            return NULL;
+        memcpy(np, p, old_size < size ? old_size : size);
+        guard_free(slot, p);
+        ATOMIC_ADD(&realloc_moved, 1);
+        return np;
+    }
 
-    free(b);
-    allocated_count--;
+    block_ele_t *b = (block_ele_t *) ((size_t) p - sizeof(block_ele_t));
+    size_t old_size = b->payload_size;
+    if (size > old_size && over_limit(size - old_size)) {
+        report_event(MSG_WARN,
+                     "Realloc returning NULL, memory limit of %d megabytes "
+                     "reached",
+                     mem_limit);
+        return NULL;
+    }
+
+    if (b->magic_header == MAGICLIGHT) {
+        block_ele_t *nb =
+            realloc(b, size + sizeof(block_ele_t) + sizeof(size_t));
+        if (!nb) {
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            error_occurred = true;
+            return NULL;
+        }
+        ATOMIC_ADD(nb == b ? &realloc_in_place : &realloc_moved, 1);
+        mem_sub(nb, true);
+        nb->payload_size = size;
+        mem_add(nb, true);
+        site_resize(nb, old_size);
+        return (void *) &nb->payload;
+    }
+
+    thread_state_t *t;
+    b = find_header(p, &t);
+    if (!t)
+        return NULL;
+    if (b->magic_header != MAGICHEADER) {
+        harness_unlock(&t->lock);
+        return NULL;
+    }
+    if (*find_footer(b) != MAGICFOOTER) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "attempting to reallocate it",
+                     p);
+        error_occurred = true;
+    }
+
+    /* Blocks of a size class already have room for the whole class */
+    block_ele_t *nb = b;
+    if (class_room(size) != class_room(old_size)) {
+        /* Keyed by address, so leave the live set while libc may move b */
+        live_remove(t, b);
+        nb = realloc(b, class_room(size) + sizeof(block_ele_t) +
+                            sizeof(size_t));
+        if (!nb) {
+            live_insert(t, b);
+            harness_unlock(&t->lock);
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            error_occurred = true;
+            return NULL;
+        }
+        live_insert(t, nb);
+        /* Neighbors still point at the old address */
+        if (nb->prev)
+            nb->prev->next = nb;
+        else
+            t->allocated = nb;
+        if (nb->next)
+            nb->next->prev = nb;
+    }
+    ATOMIC_ADD(nb == b ? &realloc_in_place : &realloc_moved, 1);
+
+    mem_sub(nb, false);
+    nb->payload_size = size;
+    mem_add(nb, false);
+    if (size > old_size)
+        memset(nb->payload + old_size, FILLCHAR, size - old_size);
+    *find_footer(nb) = MAGICFOOTER;
+    harness_unlock(&t->lock);
+
+    site_resize(nb, old_size);
+    return (void *) &nb->payload;
 }
 
 // cppcheck-suppress unusedFunction
 char *test_strdup(const char *s)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    void *new = alloc_block(len, MEM_STRING, __builtin_return_address(0));
     if (!new)
         return NULL;
 
@@ -223,7 +1089,129 @@ char *test_strdup(const char *s)
 
 size_t allocation_check()
 {
-    return allocated_count;
+    long cnt = 0;
+    harness_lock(&threads_lock);
+    for (unsigned int i = 0; i < thread_cnt; i++) {
+        thread_state_t *t = threads[i];
+        harness_lock(&t->lock);
+        cnt += t->allocated_count;
+        harness_unlock(&t->lock);
+        cnt += __atomic_load_n(&t->light_count, __ATOMIC_RELAXED);
+    }
+    harness_unlock(&threads_lock);
+    harness_lock(&guard_lock);
+    cnt += guard_live;
+    harness_unlock(&guard_lock);
+    return cnt;
+}
+
+bool guard_fault(void *addr)
+{
+    if (guard_slot_of(addr) < 0)
+        return false;
+
+    /* Pages alternate guard, data, guard, ... starting at guard_pool */
+    size_t page = ((char *) addr - guard_pool) / guard_page;
+    size_t slot = page / 2;
+    char *what = "Use after free of";
+    if (page % 2 == 0) {
+        /* Guard page, blame the block that ends right before it */
+        if (!slot || !guard_slots[slot - 1].live) {
+            report_event(MSG_ERROR, "Access to guard page at %p", addr);
+            error_occurred = true;
+            return true;
+        }
+        slot--;
+        what = "Overflow past end of";
+    }
+    guard_slot_t *g = &guard_slots[slot];
+    char where[MAX_CHAR];
+    site_name(sites[g->hdr.site].addr, where, sizeof(where));
+    report_event(MSG_ERROR, "%s %lu-byte block at %p allocated by %s", what,
+                 (unsigned long) g->hdr.payload_size, g->payload, where);
+    error_occurred = true;
+    return true;
+}
+
+void mem_window_start()
+{
+    __atomic_store_n(&mem_window_bytes,
+                     __atomic_load_n(&mem_bytes, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+}
+
+size_t mem_window_peak()
+{
+    return __atomic_load_n(&mem_window_bytes, __ATOMIC_RELAXED);
+}
+
+void set_node_size(size_t size)
+{
+    node_size = size;
+}
+
+void memory_report(int vlevel, size_t elements)
+{
+    static const char *names[MEM_CATEGORIES] = {"node", "string", "other"};
+    mem_stat_t total = {.bytes = mem_bytes, .peak_bytes = mem_peak_bytes};
+    report(vlevel, "%-8s %10s %12s %12s %12s %10s %10s", "category", "blocks",
+           "bytes", "peak bytes", "overhead", "bytes/elem", "with ovhd");
+    for (int i = 0; i <= MEM_CATEGORIES; i++) {
+        mem_stat_t m = total;
+        if (i < MEM_CATEGORIES) {
+            m = mem_stats[i];
+            total.blocks += m.blocks;
+            total.overhead += m.overhead;
+        }
+        char per[2][32] = {"-", "-"};
+        if (elements) {
+            snprintf(per[0], sizeof(per[0]), "%.1f",
+                     (double) m.bytes / elements);
+            snprintf(per[1], sizeof(per[1]), "%.1f",
+                     (double) (m.bytes + m.overhead) / elements);
+        }
+        report(vlevel, "%-8s %10lu %12lu %12lu %12lu %10s %10s",
+               i < MEM_CATEGORIES ? names[i] : "total", m.blocks, m.bytes,
+               m.peak_bytes, m.overhead, per[0], per[1]);
+    }
+}
+
+/* Order sites by live bytes, then by number of allocations */
+static int site_cmp(const void *a, const void *b)
+{
+    const site_t *sa = &sites[*(const unsigned int *) a];
+    const site_t *sb = &sites[*(const unsigned int *) b];
+    if (sa->live_bytes != sb->live_bytes)
+        return sa->live_bytes < sb->live_bytes ? 1 : -1;
+    if (sa->total_cnt != sb->total_cnt)
+        return sa->total_cnt < sb->total_cnt ? 1 : -1;
+    return 0;
+}
+
+void allocation_report(int vlevel, int limit)
+{
+    unsigned int order[SITE_CAP];
+    int n = 0;
+    for (unsigned int i = 0; i < SITE_CAP; i++) {
+        if (sites[i].total_cnt)
+            order[n++] = i;
+    }
+    qsort(order, n, sizeof(order[0]), site_cmp);
+    if (limit > 0 && limit < n)
+        n = limit;
+
+    report(vlevel, "%10s %12s %12s %12s  %s", "live", "live bytes",
+           "peak bytes", "allocs", "site");
+    for (int i = 0; i < n; i++) {
+        site_t *s = &sites[order[i]];
+        char where[MAX_CHAR];
+        site_name(s->addr, where, sizeof(where));
+        report(vlevel, "%10lu %12lu %12lu %12lu  %s", s->live_cnt,
+               s->live_bytes, s->peak_bytes, s->total_cnt, where);
+    }
+    if (realloc_in_place || realloc_moved)
+        report(vlevel, "realloc: %lu in place, %lu moved", realloc_in_place,
+               realloc_moved);
 }
 
 /*
@@ -236,11 +1224,27 @@ size_t allocation_check()
  */
 void set_cautious_mode(bool cautious)
 {
+    if (cautious_mode && !cautious) {
+        /* Unchecked frees need no set, built again on next checked one */
+        harness_lock(&threads_lock);
+        for (unsigned int i = 0; i < thread_cnt; i++) {
+            harness_lock(&threads[i]->lock);
+            threads[i]->live_built = false;
+            harness_unlock(&threads[i]->lock);
+        }
+        harness_unlock(&threads_lock);
+    }
     cautious_mode = cautious;
 }
 
+/* Override fail_probability for calling thread, negative to stop overriding */
+void set_fail_probability(int percent)
+{
+    thread_fail_probability = percent;
+}
+
 /*
- * Set/unset restricted allocation mode.
+ * Set/unset restricted allocation mode for calling thread.
  * In this mode, calls to malloc and free are disallowed.
  */
 void set_noallocate_mode(bool noallocate)
@@ -258,20 +1262,31 @@ bool error_check()
     return e;
 }
 
+static void arm_timer(long usec)
+{
+    struct itimerval it = {
+        .it_value = {.tv_sec = usec / 1000000, .tv_usec = usec % 1000000},
+    };
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
 /*
  * Prepare for a risky operation using setjmp.
  * Function returns true for initial return, false for error return
  */
 bool exception_setup(bool limit_time)
 {
-    if (sigsetjmp(env, 1)) {
-        /* Got here from longjmp */
-        jmp_ready = false;
-        if (time_limited) {
-            alarm(0);
-            time_limited = false;
-        }
+    /* Not saving the signal mask spares a system call per region */
+    if (sigsetjmp(env, 0)) {
+        /* Got here from longjmp, maybe out of a handler blocking its signal */
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGALRM);
+        sigaddset(&set, SIGSEGV);
+        sigprocmask(SIG_UNBLOCK, &set, NULL);
 
+        jmp_ready = false;
+        time_limited = false;
         if (error_message)
             report_event(MSG_ERROR, error_message);
         error_message = "";
@@ -280,9 +1295,17 @@ bool exception_setup(bool limit_time)
 
     /* Got here from initial call */
     jmp_ready = true;
-    if (limit_time) {
-        alarm(time_limit);
+    if (limit_time && time_limit > 0) {
+        /* Served from the vDSO, no system call */
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += time_limit;
+        /* Handler must not see the flag before the new deadline */
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
         time_limited = true;
+        if (!timer_armed) {
+            timer_armed = true;
+            arm_timer(time_limit * 1000000L);
+        }
     }
     return true;
 }
@@ -292,15 +1315,32 @@ bool exception_setup(bool limit_time)
  */
 void exception_cancel()
 {
-    if (time_limited) {
-        alarm(0);
-        time_limited = false;
-    }
-
+    time_limited = false;
     jmp_ready = false;
     error_message = "";
 }
 
+bool exception_timed_out()
+{
+    timer_armed = false;
+    if (!time_limited)
+        return false;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long left = (deadline.tv_sec - now.tv_sec) * 1000000L +
+                (deadline.tv_nsec - now.tv_nsec) / 1000;
+    if (left <= 0 && lock_depth) {
+        timeout_deferred = 1;
+        return false;
+    }
+    if (left <= 0)
+        return true;
+    timer_armed = true;
+    arm_timer(left);
+    return false;
+}
+
 /*
  * Use longjmp to return to most recent exception setup
  */
@@ -9,22 +9,91 @@
  * This test harness enables us to do stringent testing of code.
  * It overloads the library versions of malloc and free with ones that
  * allow checking for common allocation errors.
+ *
+ * The functions below may be called from several threads at once. Each
+ * thread keeps its own list of allocated blocks, and any thread may free a
+ * block allocated by another.
  */
 
 void *test_malloc(size_t size);
 void *test_calloc(size_t nmemb, size_t size);
 void test_free(void *p);
 char *test_strdup(const char *s);
-/* FIXME: provide test_realloc as well */
+void *test_realloc(void *p, size_t size);
 
 #ifdef INTERNAL
 
-/* Report number of allocated blocks */
+/* Report number of allocated blocks, summed over all threads */
 size_t allocation_check();
 
+/*
+ * Print live blocks, live bytes, peak live bytes and total allocations for
+ * each call site of test_malloc, test_calloc, test_strdup and test_realloc,
+ * largest live bytes first. Print only the first limit sites if limit is
+ * positive. Then tell how many reallocations kept the block in place.
+ */
+void allocation_report(int vlevel, int limit);
+
+/*
+ * Place one in guard_rate allocations of at most a page, chosen at random,
+ * right before an inaccessible page, so that overflow faults at once.
+ * 0 or less never does.
+ */
+extern int guard_rate;
+
+/*
+ * Report misuse of a guarded block if addr, the address of a faulting
+ * access, lies among guard pages.  Return false if it does not.
+ */
+bool guard_fault(void *addr);
+
+/* Kinds of data told apart by memory_report */
+typedef enum {
+    MEM_NODE,   /* Blocks of the size given to set_node_size */
+    MEM_STRING, /* Blocks from test_strdup */
+    MEM_OTHER,
+    MEM_CATEGORIES
+} mem_category_t;
+
+/*
+ * Count blocks of size bytes from test_malloc or test_calloc as nodes.
+ * 0, the default, counts them all as other.
+ */
+void set_node_size(size_t size);
+
+/*
+ * Print blocks, bytes, peak bytes and harness overhead of each category,
+ * with bytes per element of a queue of the given number of elements.
+ */
+void memory_report(int vlevel, size_t elements);
+
+/*
+ * Most megabytes of payload the code under test may hold at once.
+ * Allocations that would exceed it fail as if out of memory. 0 = unlimited.
+ */
+extern int mem_limit;
+
+/* Begin a new window over which mem_window_peak measures */
+void mem_window_start();
+
+/* Return most bytes of payload held at once since mem_window_start */
+size_t mem_window_peak();
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/*
+ * Use percent instead of fail_probability in the calling thread only.
+ * A negative percent follows fail_probability again.
+ */
+void set_fail_probability(int percent);
+
+/*
+ * Check and poison only one in sample_rate allocations, chosen at random.
+ * The others are still counted by allocation_check. 1 or less checks all.
+ */
+extern int sample_rate;
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -32,7 +101,7 @@ extern int fail_probability;
 void set_cautious_mode(bool cautious);
 
 /*
- * Set/unset restricted allocation mode.
+ * Set/unset restricted allocation mode for the calling thread.
  * In this mode, calls to malloc and free are disallowed.
  */
 void set_noallocate_mode(bool noallocate);
@@ -42,6 +111,12 @@ void set_noallocate_mode(bool noallocate);
  */
 bool error_check();
 
+/*
+ * Seconds a region set up with a time limit may run before it is aborted.
+ * 0 or less lifts the limit, as for running under valgrind.
+ */
+extern int time_limit;
+
 /*
  * Prepare for a risky operation using setjmp.
  * Function returns true for initial return, false for error return
@@ -53,6 +128,13 @@ bool exception_setup(bool limit_time);
  */
 void exception_cancel();
 
+/*
+ * Call from the SIGALRM handler.
+ * Return true if the time limit of the running exception setup has passed,
+ * otherwise arrange for the next check and return false.
+ */
+bool exception_timed_out();
+
 /*
  * Use longjmp to return to most recent exception setup.  Include error message
  */
@@ -63,6 +145,7 @@ void trigger_exception(char *msg);
 /* Tested program use our versions of malloc and free */
 #define malloc test_malloc
 #define free test_free
+#define realloc test_realloc
 
 /* Use undef to avoid strdup redefined error */
 #undef strdup
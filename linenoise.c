@@ -114,7 +114,6 @@
 #include <sys/types.h>
 #include <termios.h>
 #include <unistd.h>
-#include "tinyweb.h"
 
 #define LINENOISE_DEFAULT_HISTORY_MAX_LEN 100
 #define LINENOISE_MAX_LINE 4096
@@ -132,24 +131,6 @@ static int history_max_len = LINENOISE_DEFAULT_HISTORY_MAX_LEN;
 static int history_len = 0;
 static char **history = NULL;
 
-/* The linenoiseState structure represents the state during line editing.
- * We pass this state to functions implementing specific editing
- * functionalities. */
-struct linenoiseState {
-    int ifd;            /* Terminal stdin file descriptor. */
-    int ofd;            /* Terminal stdout file descriptor. */
-    char *buf;          /* Edited line buffer. */
-    size_t buflen;      /* Edited line buffer size. */
-    const char *prompt; /* Prompt to display. */
-    size_t plen;        /* Prompt length. */
-    size_t pos;         /* Current cursor position. */
-    size_t oldpos;      /* Previous refresh cursor position. */
-    size_t len;         /* Current edited line length. */
-    size_t cols;        /* Number of columns in terminal. */
-    size_t maxrows;     /* Maximum num of rows used so far (multiline mode) */
-    int history_index;  /* The history index we are currently editing. */
-};
-
 enum KEY_ACTION {
     KEY_NULL = 0,   /* NULL */
     CTRL_A = 1,     /* Ctrl+a */
@@ -843,250 +824,255 @@ void linenoiseEditDeletePrevWord(struct linenoiseState *l)
     refreshLine(l);
 }
 
-/* This function is the core of the line editing capability of linenoise.
- * It expects 'fd' to be already in "raw mode" so that every key pressed
- * will be returned ASAP to read().
- *
- * The resulting string is put into 'buf' when the user type enter, or
- * when ctrl+d is typed.
+/* Returned by linenoiseEditFeed() while the line is still being edited */
+char *linenoiseEditMore = "If you see this, you are misusing the API";
+
+/* Start editing a line in non-blocking fashion. The terminal is put in raw
+ * mode and the prompt is printed; the caller then invokes
+ * linenoiseEditFeed() each time 'stdin_fd' becomes readable, and finally
+ * linenoiseEditStop() once a line was returned.
  *
- * The function returns the length of the current buffer. */
-static int linenoiseEdit(int stdin_fd,
-                         int stdout_fd,
-                         char *buf,
-                         size_t buflen,
-                         const char *prompt,
-                         int tinyweb_fd,
-                         int *tinyweb_conn_fd)
+ * Returns -1 with errno set to ENOTTY when the terminal cannot be driven
+ * this way, in which case the blocking linenoise() should be used. */
+int linenoiseEditStart(struct linenoiseState *l,
+                       int stdin_fd,
+                       int stdout_fd,
+                       char *buf,
+                       size_t buflen,
+                       const char *prompt)
 {
-    struct linenoiseState l;
+    if (!isatty(stdin_fd) || isUnsupportedTerm()) {
+        errno = ENOTTY;
+        return -1;
+    }
+    if (buflen == 0) {
+        errno = EINVAL;
+        return -1;
+    }
 
     /* Populate the linenoise state that we pass to functions implementing
      * specific editing functionalities. */
-    l.ifd = stdin_fd;
-    l.ofd = stdout_fd;
-    l.buf = buf;
-    l.buflen = buflen;
-    l.prompt = prompt;
-    l.plen = strlen(prompt);
-    l.oldpos = l.pos = 0;
-    l.len = 0;
-    l.cols = getColumns(stdin_fd, stdout_fd);
-    l.maxrows = 0;
-    l.history_index = 0;
+    l->ifd = stdin_fd;
+    l->ofd = stdout_fd;
+    l->buf = buf;
+    l->buflen = buflen;
+    l->prompt = prompt;
+    l->plen = strlen(prompt);
+    l->oldpos = l->pos = 0;
+    l->len = 0;
+    l->cols = getColumns(stdin_fd, stdout_fd);
+    l->maxrows = 0;
+    l->history_index = 0;
 
     /* Buffer starts empty. */
-    l.buf[0] = '\0';
-    l.buflen--; /* Make sure there is always space for the nulterm */
+    l->buf[0] = '\0';
+    l->buflen--; /* Make sure there is always space for the nulterm */
+
+    if (enableRawMode(l->ifd) == -1)
+        return -1;
 
     /* The latest history entry is always our current buffer, that
      * initially is just an empty string. */
     linenoiseHistoryAdd("");
 
-    if (write(l.ofd, prompt, l.plen) == -1)
+    if (write(l->ofd, prompt, l->plen) == -1)
         return -1;
-    while (1) {
-        signed char c;
-        int nread;
-        char seq[3];
-        if (tinyweb_fd) {
-            fd_set set;
-            FD_ZERO(&set);
-            FD_SET(tinyweb_fd, &set);
-            FD_SET(stdin_fd, &set);
-            int rv = select(tinyweb_fd + 1, &set, NULL, NULL, NULL);
-            switch (rv) {
-            case -1:
-                perror("select"); /* an error occurred */
-                continue;
-            case 0:
-                printf("timeout occurred\n"); /* a timeout occurred */
-                continue;
-            default:
-                if (FD_ISSET(tinyweb_fd, &set)) {
-                    // web requested.
-                    *tinyweb_conn_fd = tinyweb_accept(tinyweb_fd);
-                    http_request req;
-                    parse_request(*tinyweb_conn_fd, &req);
-                    if (strlen(req.filename) >= buflen) {
-                        // request is too large!
-                        printf("web input too large to process\n");
-                        close(*tinyweb_conn_fd);
-                        continue;
-                    }
-                    printf("web input: %s", req.filename);
-                    strncpy(buf, req.filename, buflen);
-                    // replace / to ' ', simulate command line input
-                    char *replace = buf;
-                    while ((replace = strchr(replace, '/')) != NULL)
-                        *replace++ = ' ';
-                    return strlen(buf);
-                } else if (FD_ISSET(stdin_fd, &set)) {
-                    nread = read(l.ifd, &c, 1);
-                    if (nread <= 0)
-                        return l.len;
-                }
-                break;
-            }
-        } else {
-            nread = read(l.ifd, &c, 1);
-            if (nread <= 0)
-                return l.len;
-        }
-        /* Only autocomplete when the callback is set. It returns < 0 when
-         * there was an error reading from fd. Otherwise it will return the
-         * character that should be handled next. */
-        if (c == 9 && completionCallback != NULL) {
-            c = completeLine(&l);
-            /* Return on errors */
-            if (c < 0)
-                return l.len;
-            /* Read next character when 0 */
-            if (c == 0)
-                continue;
+    return 0;
+}
+
+/* This function is the core of the line editing capability of linenoise.
+ * It reads and handles a single key press from the terminal, which must
+ * have been set up by linenoiseEditStart().
+ *
+ * Returns linenoiseEditMore while the user is still editing, a heap copy
+ * of the line once enter is typed, or NULL when the input ended: on ctrl+c
+ * errno is EAGAIN, on ctrl+d over an empty line errno is ENOENT. */
+char *linenoiseEditFeed(struct linenoiseState *l)
+{
+    signed char c;
+    char seq[3];
+
+    if (read(l->ifd, &c, 1) <= 0)
+        return NULL;
+
+    /* Only autocomplete when the callback is set. It returns < 0 when
+     * there was an error reading from fd. Otherwise it will return the
+     * character that should be handled next. */
+    if (c == 9 && completionCallback != NULL) {
+        c = completeLine(l);
+        /* Return on errors */
+        if (c < 0)
+            return NULL;
+        /* Read next character when 0 */
+        if (c == 0)
+            return linenoiseEditMore;
+    }
+    switch (c) {
+    case ENTER: /* enter */
+        history_len--;
+        free(history[history_len]);
+        if (mlmode)
+            linenoiseEditMoveEnd(l);
+        if (hintsCallback) {
+            /* Force a refresh without hints to leave the previous
+             * line as the user typed it after a newline. */
+            linenoiseHintsCallback *hc = hintsCallback;
+            hintsCallback = NULL;
+            refreshLine(l);
+            hintsCallback = hc;
         }
-        switch (c) {
-        case ENTER: /* enter */
+        return strdup(l->buf);
+    case CTRL_C: /* ctrl-c */
+        errno = EAGAIN;
+        return NULL;
+    case BACKSPACE: /* backspace */
+    case 8:         /* ctrl-h */
+        linenoiseEditBackspace(l);
+        break;
+    case CTRL_D: /* ctrl-d, remove char at right of cursor, or if the
+                    line is empty, act as end-of-file. */
+        if (l->len > 0) {
+            linenoiseEditDelete(l);
+        } else {
             history_len--;
             free(history[history_len]);
-            if (mlmode)
-                linenoiseEditMoveEnd(&l);
-            if (hintsCallback) {
-                /* Force a refresh without hints to leave the previous
-                 * line as the user typed it after a newline. */
-                linenoiseHintsCallback *hc = hintsCallback;
-                hintsCallback = NULL;
-                refreshLine(&l);
-                hintsCallback = hc;
-            }
-            return (int) l.len;
-        case CTRL_C: /* ctrl-c */
-            errno = EAGAIN;
-            return -1;
-        case BACKSPACE: /* backspace */
-        case 8:         /* ctrl-h */
-            linenoiseEditBackspace(&l);
-            break;
-        case CTRL_D: /* ctrl-d, remove char at right of cursor, or if the
-                        line is empty, act as end-of-file. */
-            if (l.len > 0) {
-                linenoiseEditDelete(&l);
-            } else {
-                history_len--;
-                free(history[history_len]);
-                return -1;
-            }
-            break;
-        case CTRL_T: /* ctrl-t, swaps current character with previous. */
-            if (l.pos > 0 && l.pos < l.len) {
-                int aux = buf[l.pos - 1];
-                buf[l.pos - 1] = buf[l.pos];
-                buf[l.pos] = aux;
-                if (l.pos != l.len - 1)
-                    l.pos++;
-                refreshLine(&l);
-            }
-            break;
-        case CTRL_B: /* ctrl-b */
-            linenoiseEditMoveLeft(&l);
-            break;
-        case CTRL_F: /* ctrl-f */
-            linenoiseEditMoveRight(&l);
-            break;
-        case CTRL_P: /* ctrl-p */
-            linenoiseEditHistoryNext(&l, LINENOISE_HISTORY_PREV);
+            errno = ENOENT;
+            return NULL;
+        }
+        break;
+    case CTRL_T: /* ctrl-t, swaps current character with previous. */
+        if (l->pos > 0 && l->pos < l->len) {
+            int aux = l->buf[l->pos - 1];
+            l->buf[l->pos - 1] = l->buf[l->pos];
+            l->buf[l->pos] = aux;
+            if (l->pos != l->len - 1)
+                l->pos++;
+            refreshLine(l);
+        }
+        break;
+    case CTRL_B: /* ctrl-b */
+        linenoiseEditMoveLeft(l);
+        break;
+    case CTRL_F: /* ctrl-f */
+        linenoiseEditMoveRight(l);
+        break;
+    case CTRL_P: /* ctrl-p */
+        linenoiseEditHistoryNext(l, LINENOISE_HISTORY_PREV);
+        break;
+    case CTRL_N: /* ctrl-n */
+        linenoiseEditHistoryNext(l, LINENOISE_HISTORY_NEXT);
+        break;
+    case ESC: /* escape sequence */
+        /* Read the next two bytes representing the escape sequence.
+         * Use two calls to handle slow terminals returning the two
+         * chars at different times. */
+        if (read(l->ifd, seq, 1) == -1)
             break;
-        case CTRL_N: /* ctrl-n */
-            linenoiseEditHistoryNext(&l, LINENOISE_HISTORY_NEXT);
+        if (read(l->ifd, seq + 1, 1) == -1)
             break;
-        case ESC: /* escape sequence */
-            /* Read the next two bytes representing the escape sequence.
-             * Use two calls to handle slow terminals returning the two
-             * chars at different times. */
-            if (read(l.ifd, seq, 1) == -1)
-                break;
-            if (read(l.ifd, seq + 1, 1) == -1)
-                break;
 
-            /* ESC [ sequences. */
-            if (seq[0] == '[') {
-                if (seq[1] >= '0' && seq[1] <= '9') {
-                    /* Extended escape, read additional byte. */
-                    if (read(l.ifd, seq + 2, 1) == -1)
-                        break;
-                    if (seq[2] == '~') {
-                        switch (seq[1]) {
-                        case '3': /* Delete key. */
-                            linenoiseEditDelete(&l);
-                            break;
-                        }
-                    }
-                } else {
+        /* ESC [ sequences. */
+        if (seq[0] == '[') {
+            if (seq[1] >= '0' && seq[1] <= '9') {
+                /* Extended escape, read additional byte. */
+                if (read(l->ifd, seq + 2, 1) == -1)
+                    break;
+                if (seq[2] == '~') {
                     switch (seq[1]) {
-                    case 'A': /* Up */
-                        linenoiseEditHistoryNext(&l, LINENOISE_HISTORY_PREV);
-                        break;
-                    case 'B': /* Down */
-                        linenoiseEditHistoryNext(&l, LINENOISE_HISTORY_NEXT);
-                        break;
-                    case 'C': /* Right */
-                        linenoiseEditMoveRight(&l);
-                        break;
-                    case 'D': /* Left */
-                        linenoiseEditMoveLeft(&l);
-                        break;
-                    case 'H': /* Home */
-                        linenoiseEditMoveHome(&l);
-                        break;
-                    case 'F': /* End*/
-                        linenoiseEditMoveEnd(&l);
+                    case '3': /* Delete key. */
+                        linenoiseEditDelete(l);
                         break;
                     }
                 }
-            }
-
-            /* ESC O sequences. */
-            else if (seq[0] == 'O') {
+            } else {
                 switch (seq[1]) {
+                case 'A': /* Up */
+                    linenoiseEditHistoryNext(l, LINENOISE_HISTORY_PREV);
+                    break;
+                case 'B': /* Down */
+                    linenoiseEditHistoryNext(l, LINENOISE_HISTORY_NEXT);
+                    break;
+                case 'C': /* Right */
+                    linenoiseEditMoveRight(l);
+                    break;
+                case 'D': /* Left */
+                    linenoiseEditMoveLeft(l);
+                    break;
                 case 'H': /* Home */
-                    linenoiseEditMoveHome(&l);
+                    linenoiseEditMoveHome(l);
                     break;
                 case 'F': /* End*/
-                    linenoiseEditMoveEnd(&l);
+                    linenoiseEditMoveEnd(l);
                     break;
                 }
             }
-            break;
-        default:
-            if (linenoiseEditInsert(&l, c))
-                return -1;
-            break;
-        case CTRL_U: /* Ctrl+u, delete the whole line. */
-            buf[0] = '\0';
-            l.pos = l.len = 0;
-            refreshLine(&l);
-            break;
-        case CTRL_K: /* Ctrl+k, delete from current to end of line. */
-            buf[l.pos] = '\0';
-            l.len = l.pos;
-            refreshLine(&l);
-            break;
-        case CTRL_A: /* Ctrl+a, go to the start of the line */
-            linenoiseEditMoveHome(&l);
-            break;
-        case CTRL_E: /* ctrl+e, go to the end of the line */
-            linenoiseEditMoveEnd(&l);
-            break;
-        case CTRL_L: /* ctrl+l, clear screen */
-            linenoiseClearScreen();
-            refreshLine(&l);
-            break;
-        case CTRL_W: /* ctrl+w, delete previous word */
-            linenoiseEditDeletePrevWord(&l);
-            break;
         }
+
+        /* ESC O sequences. */
+        else if (seq[0] == 'O') {
+            switch (seq[1]) {
+            case 'H': /* Home */
+                linenoiseEditMoveHome(l);
+                break;
+            case 'F': /* End*/
+                linenoiseEditMoveEnd(l);
+                break;
+            }
+        }
+        break;
+    default:
+        if (linenoiseEditInsert(l, c))
+            return NULL;
+        break;
+    case CTRL_U: /* Ctrl+u, delete the whole line. */
+        l->buf[0] = '\0';
+        l->pos = l->len = 0;
+        refreshLine(l);
+        break;
+    case CTRL_K: /* Ctrl+k, delete from current to end of line. */
+        l->buf[l->pos] = '\0';
+        l->len = l->pos;
+        refreshLine(l);
+        break;
+    case CTRL_A: /* Ctrl+a, go to the start of the line */
+        linenoiseEditMoveHome(l);
+        break;
+    case CTRL_E: /* ctrl+e, go to the end of the line */
+        linenoiseEditMoveEnd(l);
+        break;
+    case CTRL_L: /* ctrl+l, clear screen */
+        linenoiseClearScreen();
+        refreshLine(l);
+        break;
+    case CTRL_W: /* ctrl+w, delete previous word */
+        linenoiseEditDeletePrevWord(l);
+        break;
     }
-    return l.len;
+    return linenoiseEditMore;
+}
+
+/* Finish editing started by linenoiseEditStart(), restoring the terminal */
+void linenoiseEditStop(struct linenoiseState *l)
+{
+    disableRawMode(l->ifd);
+    printf("\n");
+}
+
+/* Erase the line being edited and leave raw mode, so that the program can
+ * print output while linenoiseEditFeed() is waiting for keys. */
+void linenoiseHide(struct linenoiseState *l)
+{
+    if (write(l->ofd, "\r\x1b[0K", 5) == -1)
+        return;
+    disableRawMode(l->ifd);
+}
+
+/* Redraw the line hidden by linenoiseHide() and resume editing */
+void linenoiseShow(struct linenoiseState *l)
+{
+    if (enableRawMode(l->ifd) == -1)
+        return;
+    refreshLine(l);
 }
 
 /* This special mode is used by linenoise in order to print scan codes
@@ -1122,28 +1108,20 @@ void linenoisePrintKeyCodes(void)
     disableRawMode(STDIN_FILENO);
 }
 
-/* This function calls the line editing function linenoiseEdit() using
- * the STDIN file descriptor set in raw mode. */
-static int linenoiseRaw(char *buf,
-                        size_t buflen,
-                        const char *prompt,
-                        int tinyweb_fd,
-                        int *tinyweb_conn_fd)
+/* This function calls the line editing functions above using the STDIN
+ * file descriptor set in raw mode, blocking until a line is complete. */
+static char *linenoiseRaw(char *buf, size_t buflen, const char *prompt)
 {
-    int count;
-
-    if (buflen == 0) {
-        errno = EINVAL;
-        return -1;
-    }
-
-    if (enableRawMode(STDIN_FILENO) == -1)
-        return -1;
-    count = linenoiseEdit(STDIN_FILENO, STDOUT_FILENO, buf, buflen, prompt,
-                          tinyweb_fd, tinyweb_conn_fd);
-    disableRawMode(STDIN_FILENO);
-    printf("\n");
-    return count;
+    struct linenoiseState l;
+    char *line;
+
+    if (linenoiseEditStart(&l, STDIN_FILENO, STDOUT_FILENO, buf, buflen,
+                           prompt) == -1)
+        return NULL;
+    while ((line = linenoiseEditFeed(&l)) == linenoiseEditMore)
+        ;
+    linenoiseEditStop(&l);
+    return line;
 }
 
 /* This function is called when linenoise() is called with the standard
@@ -1190,10 +1168,9 @@ static char *linenoiseNoTTY(void)
  * for a blacklist of stupid terminals, and later either calls the line
  * editing function or uses dummy fgets() so that you will be able to type
  * something even in the most desperate of the conditions. */
-char *linenoise(const char *prompt, int tinyweb_fd, int *tinyweb_conn_fd)
+char *linenoise(const char *prompt)
 {
     char buf[LINENOISE_MAX_LINE];
-    int count;
 
     if (!isatty(STDIN_FILENO)) {
         /* Not a tty: read from file / pipe. In this mode we don't want any
@@ -1213,11 +1190,7 @@ char *linenoise(const char *prompt, int tinyweb_fd, int *tinyweb_conn_fd)
         }
         return strdup(buf);
     } else {
-        count = linenoiseRaw(buf, LINENOISE_MAX_LINE, prompt, tinyweb_fd,
-                             tinyweb_conn_fd);
-        if (count == -1)
-            return NULL;
-        return strdup(buf);
+        return linenoiseRaw(buf, LINENOISE_MAX_LINE, prompt);
     }
 }
 
@@ -35,6 +35,7 @@
 #include "queue.h"
 
 #include "console.h"
+#include "cqueue.h"
 #include "report.h"
 
 /* Settable parameters */
@@ -64,10 +65,34 @@ static list_head_meta_t l_meta;
 /* Number of elements in queue */
 static size_t lcnt = 0;
 
+/*
+ * Named queues.  The current one lives in l_meta and lcnt, which every
+ * command works on, and its slot is only brought up to date when another
+ * queue becomes current.
+ */
+#define QUEUE_MAX 16
+#define QUEUE_NAME_LEN 32
+typedef struct {
+    char name[QUEUE_NAME_LEN];
+    list_head_meta_t meta;
+    size_t cnt;
+} named_queue_t;
+
+static named_queue_t queues[QUEUE_MAX] = {{.name = "default"}};
+static int queue_cnt = 1;
+static int cur_queue = 0;
+
+/* Priority queue, tested independently from the list above */
+static struct list_head *pq = NULL;
+
+/* Number of elements in priority queue */
+static size_t pcnt = 0;
+
+/* Compact queue, tested independently from the list above */
+static cqueue_t *cq = NULL;
+
 /* tinyweb fd */
 int tinyweb_fd = 0;
-/* tinyweb connection fd */
-int tinyweb_conn_fd = 0;
 
 /* How many times can queue operations fail */
 static int fail_limit = BIG_LIST;
@@ -75,12 +100,76 @@ static int fail_count = 0;
 
 static int string_length = MAXSTRING;
 
+/* Compact queue after sort when it has more elements than this (0 = never) */
+static int compact_threshold = 0;
+
+/* Print allocation sites at quit when nonzero */
+static int profile_sites = 0;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
 
 /* Forward declarations */
 static bool show_queue(int vlevel);
+static bool show_pq(int vlevel);
+
+/*
+ * Blocks held outside the current list: every other named queue and the
+ * priority queue have a descriptor plus node and string for each element, the
+ * compact queue a descriptor, pool and arena
+ */
+static size_t side_blocks()
+{
+    size_t cnt = (pq ? 1 + 2 * pcnt : 0) + (cq ? 3 : 0);
+    for (int i = 0; i < queue_cnt; i++) {
+        if (i != cur_queue && queues[i].meta.l)
+            cnt += 1 + 2 * queues[i].cnt;
+    }
+    return cnt;
+}
+
+/* Return index of queue called name, or -1 if there is none */
+static int queue_find(const char *name)
+{
+    for (int i = 0; i < queue_cnt; i++) {
+        if (!strcmp(queues[i].name, name))
+            return i;
+    }
+    return -1;
+}
+
+/* Park current queue in its slot and make queue i current */
+static void queue_switch(int i)
+{
+    queues[cur_queue].meta = l_meta;
+    queues[cur_queue].cnt = lcnt;
+    l_meta = queues[i].meta;
+    lcnt = queues[i].cnt;
+    cur_queue = i;
+}
+
+/*
+ * Return the existing queue called name, other than the current one, for a
+ * command moving elements between the two.  Return NULL if there is none.
+ */
+static named_queue_t *queue_other(const char *cmd, const char *name)
+{
+    int i = queue_find(name);
+    if (i < 0) {
+        report(1, "No queue named '%s'", name);
+        return NULL;
+    }
+    if (i == cur_queue) {
+        report(1, "%s needs a queue other than the current one", cmd);
+        return NULL;
+    }
+    if (!l_meta.l || !queues[i].meta.l) {
+        report(1, "%s cannot be applied to a null queue", cmd);
+        return NULL;
+    }
+    return &queues[i];
+}
 
 static bool do_free(int argc, char *argv[])
 {
@@ -106,7 +195,7 @@ static bool do_free(int argc, char *argv[])
     lcnt = 0;
     show_queue(3);
 
-    size_t bcnt = allocation_check();
+    size_t bcnt = allocation_check() - side_blocks();
     if (bcnt > 0) {
         report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
                bcnt);
@@ -118,15 +207,35 @@ static bool do_free(int argc, char *argv[])
 
 static bool do_new(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
         return false;
     }
 
+    if (argc == 2) {
+        int i = queue_find(argv[1]);
+        if (i < 0) {
+            if (strlen(argv[1]) >= QUEUE_NAME_LEN) {
+                report(1, "Queue name '%s' is too long", argv[1]);
+                return false;
+            }
+            if (queue_cnt == QUEUE_MAX) {
+                report(1, "Cannot have more than %d queues", QUEUE_MAX);
+                return false;
+            }
+            i = queue_cnt++;
+            strcpy(queues[i].name, argv[1]);
+            queues[i].meta.l = NULL;
+            queues[i].meta.size = 0;
+            queues[i].cnt = 0;
+        }
+        queue_switch(i);
+    }
+
     bool ok = true;
     if (l_meta.l) {
         report(3, "Freeing old queue");
-        ok = do_free(argc, argv);
+        ok = do_free(1, argv);
     }
     error_check();
 
@@ -603,6 +712,69 @@ static bool do_size(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Keeps the traversal below from being optimized away */
+static volatile char traversal_sink;
+
+/* Walk queue touching every string.  Return elapsed time in seconds */
+static double traversal_time()
+{
+    double t;
+    char c = 0;
+    init_time(&t);
+    if (l_meta.l) {
+        element_t *item;
+        list_for_each_entry (item, l_meta.l, list)
+            c ^= item->value[0];
+    }
+    traversal_sink = c;
+    return delta_time(&t);
+}
+
+static bool compact_queue()
+{
+    bool ok = true;
+    if (lcnt > big_list_size)
+        set_cautious_mode(false);
+    if (exception_setup(true))
+        ok = q_compact(l_meta.l);
+    exception_cancel();
+    set_cautious_mode(true);
+    return ok;
+}
+
+static bool do_compact(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!l_meta.l)
+        report(3, "Warning: Calling compact on null queue");
+    error_check();
+
+    double before = traversal_time();
+    bool ok = compact_queue();
+    double after = traversal_time();
+
+    if (ok) {
+        report(2, "Traversal time before = %.3f ms, after = %.3f ms",
+               before * 1000, after * 1000);
+    } else {
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Compaction failed");
+            ok = true;
+        } else {
+            report(1, "ERROR: Compaction failed (%d failures total)",
+                   fail_count);
+        }
+    }
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
 bool do_sort(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -642,6 +814,59 @@ bool do_sort(int argc, char *argv[])
         }
     }
 
+    if (ok && compact_threshold > 0 && lcnt > compact_threshold &&
+        !compact_queue())
+        report(2, "Compaction after sort failed");
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+static bool do_topk(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    int k = 0;
+    if (!get_int(argv[1], &k) || k < 0) {
+        report(1, "Invalid number of elements '%s'", argv[1]);
+        return false;
+    }
+
+    if (!l_meta.l)
+        report(3, "Warning: Calling topk on null queue");
+    error_check();
+
+    bool ok = true;
+    if (exception_setup(true))
+        ok = q_partial_sort(l_meta.l, k);
+    exception_cancel();
+
+    if (!ok) {
+        report(1, "ERROR: Partial sort failed");
+        return false;
+    }
+
+    if (l_meta.size) {
+        /* Prefix of length k must be ascending and no larger than the rest */
+        struct list_head *cur_l = l_meta.l->next;
+        element_t *last = NULL;
+        for (int i = 0; cur_l != l_meta.l; i++, cur_l = cur_l->next) {
+            element_t *item = list_entry(cur_l, element_t, list);
+            if (last && strcmp(last->value, item->value) > 0) {
+                report(1, i < k ? "ERROR: First %d elements not sorted"
+                                : "ERROR: First %d elements not smallest",
+                       k);
+                ok = false;
+                break;
+            }
+            if (i < k)
+                last = item;
+        }
+    }
+
     show_queue(3);
     return ok && !error_check();
 }
@@ -687,6 +912,137 @@ static bool do_swap(int argc, char *argv[])
     show_queue(3);
     return !error_check();
 }
+static bool do_use(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s takes 1 argument", argv[0]);
+        return false;
+    }
+
+    int i = queue_find(argv[1]);
+    if (i < 0) {
+        report(1, "No queue named '%s'", argv[1]);
+        return false;
+    }
+    queue_switch(i);
+    show_queue(3);
+    return true;
+}
+
+/*
+ * Account n elements moved from queue q to the current one, or the other way
+ * when n is negative
+ */
+static void queue_transfer(named_queue_t *q, long n)
+{
+    lcnt += n;
+    l_meta.size += n;
+    q->cnt -= n;
+    q->meta.size -= n;
+    /* Linked directly, so neither queue's cached shape holds any more */
+    q_invalidate(l_meta.l);
+    q_invalidate(q->meta.l);
+}
+
+static bool do_splice(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s takes 1 argument", argv[0]);
+        return false;
+    }
+
+    named_queue_t *q = queue_other(argv[0], argv[1]);
+    if (!q)
+        return false;
+
+    list_splice_tail_init(q->meta.l, l_meta.l);
+    queue_transfer(q, q->cnt);
+    show_queue(3);
+    return true;
+}
+
+static inline const char *node_value(struct list_head *node)
+{
+    return list_entry(node, element_t, list)->value;
+}
+
+static bool do_merge(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s takes 1 argument", argv[0]);
+        return false;
+    }
+
+    named_queue_t *q = queue_other(argv[0], argv[1]);
+    if (!q)
+        return false;
+
+    /*
+     * Move each run of the other queue that sorts before the next element
+     * of this one as a whole, so elements are compared but never relinked
+     * one at a time.  Equal strings of this queue come first.
+     */
+    struct list_head *head = l_meta.l, *other = q->meta.l;
+    struct list_head *pos = head->next;
+    size_t moved = q->cnt;
+    while (!list_empty(other)) {
+        const char *first = node_value(other->next);
+        while (pos != head && strcmp(node_value(pos), first) <= 0)
+            pos = pos->next;
+        if (pos == head) {
+            list_splice_tail_init(other, head);
+            break;
+        }
+
+        const char *bound = node_value(pos);
+        struct list_head *last = other->next;
+        while (last->next != other && strcmp(node_value(last->next), bound) < 0)
+            last = last->next;
+        LIST_HEAD(run);
+        list_cut_position(&run, other, last);
+        list_splice_tail(&run, pos);
+    }
+    queue_transfer(q, moved);
+    show_queue(3);
+    return true;
+}
+
+static bool do_move(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3) {
+        report(1, "%s takes 1-2 arguments", argv[0]);
+        return false;
+    }
+
+    int n = 1;
+    if (argc == 3 && (!get_int(argv[2], &n) || n < 0)) {
+        report(1, "Invalid number of elements '%s'", argv[2]);
+        return false;
+    }
+
+    named_queue_t *q = queue_other(argv[0], argv[1]);
+    if (!q)
+        return false;
+    if ((size_t) n > lcnt) {
+        report(1, "Cannot move %d elements out of %lu", n, lcnt);
+        return false;
+    }
+
+    if ((size_t) n == lcnt) {
+        list_splice_tail_init(l_meta.l, q->meta.l);
+    } else if (n > 0) {
+        struct list_head *last = l_meta.l;
+        for (int i = 0; i < n; i++)
+            last = last->next;
+        LIST_HEAD(run);
+        list_cut_position(&run, l_meta.l, last);
+        list_splice_tail(&run, q->meta.l);
+    }
+    queue_transfer(q, -n);
+    show_queue(3);
+    return true;
+}
+
 static bool do_shuffle(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -729,6 +1085,7 @@ static bool do_shuffle(int argc, char *argv[])
         }
         max--;
     }
+    q_invalidate(l_meta.l);
     exception_cancel();
 
     set_noallocate_mode(false);
@@ -771,7 +1128,8 @@ static bool show_queue(int vlevel)
         return false;
     }
 
-    report_noreturn(vlevel, "l = [");
+    report_start();
+    report_add_str("l = [");
 
     struct list_head *ori = l_meta.l;
     struct list_head *cur = l_meta.l->next;
@@ -779,8 +1137,11 @@ static bool show_queue(int vlevel)
     if (exception_setup(true)) {
         while (ok && ori != cur && cnt < lcnt) {
             element_t *e = list_entry(cur, element_t, list);
-            if (cnt < big_list_size)
-                report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
+            if (cnt < big_list_size) {
+                if (cnt)
+                    report_add_str(" ");
+                report_add_str(e->value);
+            }
             cnt++;
             cur = cur->next;
             ok = ok && !error_check();
@@ -789,17 +1150,14 @@ static bool show_queue(int vlevel)
     exception_cancel();
 
     if (!ok) {
-        report(vlevel, " ... ]");
+        report_add_str(" ... ]");
+        report_end(vlevel);
         return false;
     }
 
-    if (cur == ori) {
-        if (cnt <= big_list_size)
-            report(vlevel, "]");
-        else
-            report(vlevel, " ... ]");
-    } else {
-        report(vlevel, " ... ]");
+    report_add_str(cur == ori && cnt <= big_list_size ? "]" : " ... ]");
+    report_end(vlevel);
+    if (cur != ori) {
         report(vlevel, "ERROR:  Queue has more than %d elements", lcnt);
         ok = false;
     }
@@ -815,6 +1173,499 @@ static bool do_show(int argc, char *argv[])
     }
     return show_queue(0);
 }
+
+/* Names of shape flags, as given to meta */
+static const struct {
+    const char *name;
+    unsigned int flag;
+} meta_flags[] = {
+    {"asc", Q_SORTED_ASC},
+    {"desc", Q_SORTED_DESC},
+    {"unique", Q_UNIQUE},
+    {"counted", Q_COUNTED},
+    {NULL, 0},
+};
+
+static bool do_meta(int argc, char *argv[])
+{
+    /* Flags expected to be known, exactly those named or none */
+    unsigned int expect = 0;
+    for (int i = 1; i < argc; i++) {
+        int j = 0;
+        while (meta_flags[j].name && strcmp(argv[i], meta_flags[j].name))
+            j++;
+        if (meta_flags[j].name) {
+            expect |= meta_flags[j].flag;
+        } else if (strcmp(argv[i], "none")) {
+            report(1,
+                   "Unknown flag '%s', expected asc, desc, unique, counted "
+                   "or none",
+                   argv[i]);
+            return false;
+        }
+    }
+
+    int cnt = 0;
+    unsigned int flags = q_meta(l_meta.l, &cnt);
+    if (!l_meta.l) {
+        report(1, "l = NULL");
+    } else {
+        report(1, "sorted ascending  = %s",
+               flags & Q_SORTED_ASC ? "yes" : "unknown");
+        report(1, "sorted descending = %s",
+               flags & Q_SORTED_DESC ? "yes" : "unknown");
+        report(1, "unique            = %s",
+               flags & Q_UNIQUE ? "yes" : "unknown");
+        if (flags & Q_COUNTED)
+            report(1, "count             = %d", cnt);
+        else
+            report(1, "count             = unknown");
+    }
+
+    if (argc > 1 && flags != expect) {
+        report(1, "ERROR: Queue does not know exactly the expected flags");
+        return false;
+    }
+    return true;
+}
+
+static bool do_mem(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    memory_report(1, lcnt);
+    if (mem_limit > 0)
+        report(1, "limit: %d megabytes", mem_limit);
+    report_cmd_mem(1);
+    return true;
+}
+
+static bool do_sites(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes at most one argument", argv[0]);
+        return false;
+    }
+
+    int limit = 0;
+    if (argc == 2 && (!get_int(argv[1], &limit) || limit < 1)) {
+        report(1, "Invalid number of sites '%s'", argv[1]);
+        return false;
+    }
+
+    allocation_report(1, limit);
+    return true;
+}
+
+static bool do_pnew(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (pq)
+        report(3, "Freeing old priority queue");
+    error_check();
+
+    if (pcnt > big_list_size)
+        set_cautious_mode(false);
+    if (exception_setup(true)) {
+        q_free(pq);
+        pq = q_pq_new();
+    }
+    exception_cancel();
+    set_cautious_mode(true);
+    pcnt = 0;
+    show_pq(3);
+
+    return !error_check();
+}
+
+static bool do_pfree(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!pq)
+        report(3, "Warning: Calling free on null priority queue");
+    error_check();
+
+    if (pcnt > big_list_size)
+        set_cautious_mode(false);
+    if (exception_setup(true))
+        q_free(pq);
+    exception_cancel();
+    set_cautious_mode(true);
+
+    pq = NULL;
+    pcnt = 0;
+    show_pq(3);
+    return !error_check();
+}
+
+/*
+ * Insert reps copies of inserts (or random strings if need_rand) into h.
+ * Return the number of successful insertions through *cnt.
+ */
+static bool pq_fill(struct list_head *h,
+                    char *inserts,
+                    bool need_rand,
+                    int reps,
+                    size_t *cnt)
+{
+    bool ok = true;
+    for (int r = 0; ok && r < reps; r++) {
+        if (need_rand)
+            fill_rand_string(inserts, MAX_RANDSTR_LEN);
+        if (q_pq_insert(h, inserts)) {
+            (*cnt)++;
+        } else {
+            fail_count++;
+            if (fail_count < fail_limit)
+                report(2, "Insertion of %s failed", inserts);
+            else {
+                report(1, "ERROR: Insertion of %s failed (%d failures total)",
+                       inserts, fail_count);
+                ok = false;
+            }
+        }
+        ok = ok && !error_check();
+    }
+    return ok;
+}
+
+/* Parse "str [n]" arguments of insertion commands */
+static bool insert_args(int argc,
+                        char *argv[],
+                        char *randstr_buf,
+                        char **inserts,
+                        bool *need_rand,
+                        int *reps)
+{
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
+
+    *reps = 1;
+    if (argc == 3 && !get_int(argv[2], reps)) {
+        report(1, "Invalid number of insertions '%s'", argv[2]);
+        return false;
+    }
+
+    *need_rand = !strcmp(argv[1], "RAND");
+    *inserts = *need_rand ? randstr_buf : argv[1];
+    return true;
+}
+
+static bool do_pins(int argc, char *argv[])
+{
+    char randstr_buf[MAX_RANDSTR_LEN];
+    char *inserts;
+    bool need_rand;
+    int reps;
+    if (!insert_args(argc, argv, randstr_buf, &inserts, &need_rand, &reps))
+        return false;
+
+    if (!pq)
+        report(3, "Warning: Calling insert on null priority queue");
+    error_check();
+
+    bool ok = true;
+    if (exception_setup(true))
+        ok = pq_fill(pq, inserts, need_rand, reps, &pcnt);
+    exception_cancel();
+
+    show_pq(3);
+    return ok && !error_check();
+}
+
+static bool do_pmeld(int argc, char *argv[])
+{
+    char randstr_buf[MAX_RANDSTR_LEN];
+    char *inserts;
+    bool need_rand;
+    int reps;
+    if (!insert_args(argc, argv, randstr_buf, &inserts, &need_rand, &reps))
+        return false;
+
+    if (!pq)
+        report(3, "Warning: Calling meld on null priority queue");
+    error_check();
+
+    bool ok = true;
+    size_t ocnt = 0;
+    struct list_head *other = NULL;
+    if (exception_setup(true)) {
+        other = q_pq_new();
+        if (other)
+            ok = pq_fill(other, inserts, need_rand, reps, &ocnt);
+        if (ok && q_pq_meld(pq, other)) {
+            pcnt += ocnt;
+            ocnt = 0;
+        }
+        if (ok && ocnt) {
+            report(1, "ERROR: Meld left %lu elements behind", ocnt);
+            ok = false;
+        }
+        if (q_size(other) != 0) {
+            report(1, "ERROR: Melded priority queue is not empty");
+            ok = false;
+        }
+        q_free(other);
+    }
+    exception_cancel();
+
+    show_pq(3);
+    return ok && !error_check();
+}
+
+static bool do_ppop(int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s needs 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    char *removes = malloc(string_length + 1);
+    if (!removes) {
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for removed strings");
+        return false;
+    }
+    removes[0] = '\0';
+
+    if (!pcnt)
+        report(3, "Warning: Calling pop on empty priority queue");
+    error_check();
+
+    bool ok = true;
+    element_t *re = NULL, *next = NULL;
+    if (exception_setup(true)) {
+        re = q_pq_remove_min(pq, removes, string_length + 1);
+        next = q_pq_min(pq);
+    }
+    exception_cancel();
+
+    if (re) {
+        if (next && strcmp(re->value, next->value) > 0) {
+            report(1, "ERROR: Removed %s but %s is smaller", re->value,
+                   next->value);
+            ok = false;
+        }
+        q_release_element(re);
+        report(2, "Removed %s from priority queue", removes);
+        pcnt--;
+    } else {
+        fail_count++;
+        if (argc == 1 && fail_count < fail_limit) {
+            report(2, "Removal from priority queue failed");
+        } else {
+            report(1,
+                   "ERROR: Removal from priority queue failed (%d failures "
+                   "total)",
+                   fail_count);
+            ok = false;
+        }
+    }
+
+    if (ok && argc == 2 && strcmp(removes, argv[1])) {
+        report(1, "ERROR: Removed value %s != expected value %s", removes,
+               argv[1]);
+        ok = false;
+    }
+
+    show_pq(3);
+    free(removes);
+    return ok && !error_check();
+}
+
+static bool show_pq(int vlevel)
+{
+    if (verblevel < vlevel)
+        return true;
+
+    if (!pq) {
+        report(vlevel, "pq = NULL");
+        return true;
+    }
+
+    int cnt = q_size(pq);
+    element_t *min = q_pq_min(pq);
+    if (cnt != pcnt) {
+        report(vlevel, "ERROR: Priority queue size is %d, but expected %lu",
+               cnt, pcnt);
+        return false;
+    }
+    report(vlevel, "pq = [%s%s] (%d elements)", min ? min->value : "",
+           cnt > 1 ? " ..." : "", cnt);
+    return true;
+}
+
+static bool show_cq(int vlevel)
+{
+    if (verblevel < vlevel)
+        return true;
+
+    if (!cq) {
+        report(vlevel, "cq = NULL");
+        return true;
+    }
+
+    int cnt = 0;
+    uint32_t idx;
+    report_start();
+    report_add_str("cq = [");
+    cq_for_each (idx, cq) {
+        if (cnt < big_list_size) {
+            if (cnt)
+                report_add_str(" ");
+            report_add_str(cq_value(cq, idx));
+        }
+        cnt++;
+    }
+    report_add("%s] (%d elements, %lu bytes)",
+               cnt > big_list_size ? " ..." : "", cnt, cq_footprint(cq));
+    report_end(vlevel);
+
+    if (cnt != cq_size(cq)) {
+        report(vlevel, "ERROR: Compact queue has %d elements, but size is %d",
+               cnt, cq_size(cq));
+        return false;
+    }
+    return true;
+}
+
+/* Insert into or remove from compact queue, arguments as for ih/it/rh/rt */
+static bool cq_op(bool tail, bool insert, int argc, char *argv[])
+{
+    bool ok = true;
+    if (insert) {
+        char randstr_buf[MAX_RANDSTR_LEN];
+        char *inserts;
+        bool need_rand;
+        int reps;
+        if (!insert_args(argc, argv, randstr_buf, &inserts, &need_rand, &reps))
+            return false;
+        for (int r = 0; ok && r < reps; r++) {
+            if (need_rand)
+                fill_rand_string(inserts, MAX_RANDSTR_LEN);
+            if (!(tail ? cq_insert_tail(cq, inserts)
+                       : cq_insert_head(cq, inserts))) {
+                fail_count++;
+                if (fail_count < fail_limit)
+                    report(2, "Insertion of %s failed", inserts);
+                else {
+                    report(1,
+                           "ERROR: Insertion of %s failed (%d failures total)",
+                           inserts, fail_count);
+                    ok = false;
+                }
+            }
+        }
+        return ok;
+    }
+
+    if (argc != 1 && argc != 2) {
+        report(1, "%s needs 0-1 arguments", argv[0]);
+        return false;
+    }
+    char removes[MAXSTRING + 1] = "";
+    bool removed = tail ? cq_remove_tail(cq, removes, sizeof(removes))
+                        : cq_remove_head(cq, removes, sizeof(removes));
+    if (removed) {
+        report(2, "Removed %s from compact queue", removes);
+        if (argc == 2 && strcmp(removes, argv[1])) {
+            report(1, "ERROR: Removed value %s != expected value %s", removes,
+                   argv[1]);
+            ok = false;
+        }
+    } else {
+        fail_count++;
+        if (argc == 1 && fail_count < fail_limit) {
+            report(2, "Removal from compact queue failed");
+        } else {
+            report(1,
+                   "ERROR: Removal from compact queue failed (%d failures "
+                   "total)",
+                   fail_count);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+static bool do_cq(int argc, char *argv[])
+{
+    if (argc < 2) {
+        report(1, "%s needs an operation", argv[0]);
+        return false;
+    }
+
+    char *op = argv[1];
+    /* Arguments of the operation, with op itself as argv[0] */
+    argc--;
+    argv++;
+
+    if (!strcmp(op, "new") || !strcmp(op, "free")) {
+        cq_free(cq);
+        cq = !strcmp(op, "new") ? cq_new() : NULL;
+        show_cq(3);
+        return !error_check();
+    }
+
+    if (!cq)
+        report(3, "Warning: Calling %s on null compact queue", op);
+    error_check();
+
+    bool ok = true;
+    if (exception_setup(true)) {
+        if (!strcmp(op, "ih") || !strcmp(op, "it"))
+            ok = cq_op(op[1] == 't', true, argc, argv);
+        else if (!strcmp(op, "rh") || !strcmp(op, "rt"))
+            ok = cq_op(op[1] == 't', false, argc, argv);
+        else if (!strcmp(op, "size"))
+            report(2, "Queue size = %d", cq_size(cq));
+        else if (!strcmp(op, "dm"))
+            ok = cq_delete_mid(cq);
+        else if (!strcmp(op, "dedup"))
+            ok = cq_delete_dup(cq);
+        else if (!strcmp(op, "swap"))
+            cq_swap(cq);
+        else if (!strcmp(op, "reverse"))
+            cq_reverse(cq);
+        else if (!strcmp(op, "sort"))
+            cq_sort(cq);
+        else if (strcmp(op, "show")) {
+            report(1, "Unknown compact queue operation '%s'", op);
+            ok = false;
+        }
+    }
+    exception_cancel();
+
+    if (cq && !strcmp(op, "sort")) {
+        const char *last = NULL;
+        uint32_t idx;
+        cq_for_each (idx, cq) {
+            if (last && strcmp(last, cq_value(cq, idx)) > 0) {
+                report(1, "ERROR: Not sorted in ascending order");
+                ok = false;
+                break;
+            }
+            last = cq_value(cq, idx);
+        }
+    }
+
+    ok = show_cq(!strcmp(op, "show") ? 0 : 3) && ok;
+    return ok && !error_check();
+}
+
 static bool do_web(int argc, char *argv[])
 {
     if (tinyweb_fd) {
@@ -827,8 +1678,20 @@ static bool do_web(int argc, char *argv[])
 }
 static void console_init()
 {
-    ADD_COMMAND(new, "                | Create new queue");
+    ADD_COMMAND(new,
+                " [name]         | Create new queue, named queue becomes "
+                "current");
     ADD_COMMAND(free, "                | Delete queue");
+    ADD_COMMAND(use, " name           | Make named queue current");
+    ADD_COMMAND(splice,
+                " name           | Move all elements of named queue to tail "
+                "of queue");
+    ADD_COMMAND(merge,
+                " name           | Merge sorted named queue into sorted "
+                "queue");
+    ADD_COMMAND(move,
+                " name [n]       | Move n elements from head of queue to "
+                "tail of named queue (default: n == 1)");
     ADD_COMMAND(
         ih,
         " str [n]        | Insert string str at head of queue n times. "
@@ -850,6 +1713,11 @@ static void console_init()
         "                | Remove from head of queue without reporting value.");
     ADD_COMMAND(reverse, "                | Reverse queue");
     ADD_COMMAND(sort, "                | Sort queue in ascending order");
+    ADD_COMMAND(topk,
+                " k              | Move k smallest elements to front in "
+                "ascending order");
+    ADD_COMMAND(compact,
+                "                | Reallocate queue elements in list order");
     ADD_COMMAND(
         size, " [n]            | Compute queue size n times (default: n == 1)");
     ADD_COMMAND(show, "                | Show queue contents");
@@ -858,6 +1726,32 @@ static void console_init()
         dedup, "                | Delete all nodes that have duplicate string");
     ADD_COMMAND(swap,
                 "                | Swap every two adjacent nodes in queue");
+    ADD_COMMAND(meta,
+                " [flags]        | Show shape metadata tracked by queue, "
+                "checking that exactly flags are known if given");
+    ADD_COMMAND(mem,
+                "                | Show bytes held by nodes, strings and other "
+                "blocks, per element of queue, and peak bytes of commands");
+    ADD_COMMAND(sites,
+                " [n]            | Show allocations per call site, n largest "
+                "by live bytes (default: all)");
+    ADD_COMMAND(cq,
+                " op [arg ...]   | Apply queue command op (new, free, ih, it, "
+                "rh, rt, size, dm, dedup, swap, reverse, sort, show) to "
+                "compact queue");
+    ADD_COMMAND(pnew, "                | Create new priority queue");
+    ADD_COMMAND(pfree, "                | Delete priority queue");
+    ADD_COMMAND(pins,
+                " str [n]        | Insert string str into priority queue n "
+                "times. Generate random string(s) if str equals RAND.");
+    ADD_COMMAND(
+        pmeld,
+        " str [n]        | Build a second priority queue of n copies of str "
+        "and meld it into priority queue");
+    ADD_COMMAND(
+        ppop,
+        " [str]          | Remove smallest string from priority queue.  "
+        "Optionally compare to expected value str");
     ADD_COMMAND(shuffle,
                 "            | create a tinyweb to listerner 9999 tcp port");
     ADD_COMMAND(web,
@@ -866,22 +1760,46 @@ static void console_init()
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("sample", &sample_rate,
+              "Check and poison one in n allocations (1 = all)", NULL);
+    add_param("memlimit", &mem_limit,
+              "Megabytes the queue may hold at once (0 = unlimited)", NULL);
+    add_param("guard", &guard_rate,
+              "Place one in n allocations against a guard page (0 = never)",
+              NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_param("compact", &compact_threshold,
+              "Compact queue after sort when larger than this size (0 = never)",
+              NULL);
+    add_param("profile", &profile_sites,
+              "Show allocations per call site at quit (0 = no)", NULL);
+    add_param("time", &time_limit,
+              "Seconds a command may run (0 = unlimited, initially "
+              "$QTEST_TIME_LIMIT if set)",
+              NULL);
 }
 
 /* Signal handlers */
-static void sigsegvhandler(int sig)
+static void sigsegvhandler(int sig, siginfo_t *info, void *ucontext)
 {
-    report(1,
-           "Segmentation fault occurred.  You dereferenced a NULL or invalid "
-           "pointer");
+    /* Overflow or use after free of a guarded block, already reported */
+    if (guard_fault(info->si_addr))
+        trigger_exception("Invalid access to guarded block");
+
+    /* Formatting and flushing are not async-signal-safe */
+    report_crash(
+        "Segmentation fault occurred.  You dereferenced a NULL or invalid "
+        "pointer\n");
     /* Raising a SIGABRT signal to produce a core dump for debugging. */
     abort();
 }
 
 static void sigalrmhandler(int sig)
 {
+    /* Timer keeps running between commands, only act on a late one */
+    if (!exception_timed_out())
+        return;
     trigger_exception(
         "Time limit exceeded.  Either you are in an infinite loop, or your "
         "code is too inefficient");
@@ -891,21 +1809,51 @@ static void queue_init()
 {
     fail_count = 0;
     l_meta.l = NULL;
-    signal(SIGSEGV, sigsegvhandler);
+    set_node_size(sizeof(element_t));
+    struct sigaction sa = {.sa_sigaction = sigsegvhandler,
+                           .sa_flags = SA_SIGINFO};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
     signal(SIGALRM, sigalrmhandler);
 }
 
 static bool queue_quit(int argc, char *argv[])
 {
+    if (profile_sites)
+        allocation_report(1, 0);
+
     report(3, "Freeing queue");
     if (lcnt > big_list_size)
         set_cautious_mode(false);
-
     if (exception_setup(true))
         q_free(l_meta.l);
     exception_cancel();
     set_cautious_mode(true);
 
+    for (int i = 0; i < queue_cnt; i++) {
+        if (i == cur_queue)
+            continue;
+        if (queues[i].cnt > big_list_size)
+            set_cautious_mode(false);
+        if (exception_setup(true))
+            q_free(queues[i].meta.l);
+        exception_cancel();
+        set_cautious_mode(true);
+        queues[i].meta.l = NULL;
+    }
+
+    if (pcnt > big_list_size)
+        set_cautious_mode(false);
+    if (exception_setup(true))
+        q_free(pq);
+    exception_cancel();
+    set_cautious_mode(true);
+    pq = NULL;
+    pcnt = 0;
+
+    cq_free(cq);
+    cq = NULL;
+
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
         report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
@@ -918,11 +1866,17 @@ static bool queue_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf(
+        "Usage: %s [-h] [-f IFILE][-b BFILE][-v VLEVEL][-l|-L LFILE]"
+        "[-j JFILE]\n",
+        cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
+    printf("\t-b BFILE   Compile IFILE into BFILE instead of running it\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-L LFILE   Like -l, but write LFILE from a background thread\n");
+    printf("\t-j JFILE   Write latency of each command to JFILE at quit\n");
     exit(0);
 }
 
@@ -971,10 +1925,15 @@ int main(int argc, char *argv[])
     char *infile_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
+    bool log_async = false;
+    char jbuf[BUFSIZE];
+    char *jfile_name = NULL;
+    char bbuf[BUFSIZE];
+    char *bfile_name = NULL;
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:b:l:L:j:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -984,6 +1943,11 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             infile_name = buf;
             break;
+        case 'b':
+            strncpy(bbuf, optarg, BUFSIZE);
+            bbuf[BUFSIZE - 1] = '\0';
+            bfile_name = bbuf;
+            break;
         case 'v': {
             char *endptr;
             errno = 0;
@@ -994,9 +1958,17 @@ int main(int argc, char *argv[])
             }
             break;
         }
+        case 'j':
+            strncpy(jbuf, optarg, BUFSIZE);
+            jbuf[BUFSIZE - 1] = '\0';
+            jfile_name = jbuf;
+            break;
+        case 'L':
+            log_async = true;
+            /* fall through */
         case 'l':
             strncpy(lbuf, optarg, BUFSIZE);
-            buf[BUFSIZE - 1] = '\0';
+            lbuf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
         default:
@@ -1006,6 +1978,11 @@ int main(int argc, char *argv[])
         }
     }
 
+    /* Lets slow runs such as under valgrind lift the limit for every trace */
+    char *limit = getenv("QTEST_TIME_LIMIT");
+    if (limit)
+        time_limit = atoi(limit);
+
     srand((unsigned int) (time(NULL)));
     queue_init();
     init_cmd();
@@ -1021,12 +1998,22 @@ int main(int argc, char *argv[])
         set_echo(true);
     }
     if (logfile_name)
-        set_logfile(logfile_name);
+        set_logfile(logfile_name, log_async);
+    if (jfile_name)
+        set_stats_file(jfile_name);
 
     add_quit_helper(queue_quit);
 
     bool ok = true;
-    ok = ok && run_console(infile_name, &tinyweb_fd, &tinyweb_conn_fd);
+    if (bfile_name) {
+        if (!infile_name) {
+            fprintf(stderr, "No IFILE given to compile\n");
+            exit(EXIT_FAILURE);
+        }
+        ok = compile_file(infile_name, bfile_name);
+    } else {
+        ok = run_console(infile_name, &tinyweb_fd);
+    }
     ok = ok && finish_cmd();
 
     return ok ? 0 : 1;
@@ -11,32 +11,61 @@
  *   cppcheck-suppress nullPointer
  */
 
+/*
+ * Queue descriptor.
+ * The list head is placed first, so the pointer returned by q_new can be
+ * treated as a plain struct list_head by the caller.
+ */
+typedef struct {
+    struct list_head head;
+    unsigned int flags;
+    int count;
+    /* Elements form a pairing heap instead of a list, see q_pq_new */
+    bool heap;
+} queue_desc_t;
+
+#define Q_ORDER (Q_SORTED_ASC | Q_SORTED_DESC | Q_UNIQUE)
+#define Q_ALL (Q_ORDER | Q_COUNTED)
+
+static inline queue_desc_t *q_desc(struct list_head *head)
+{
+    return container_of(head, queue_desc_t, head);
+}
+
 /*
  * Create empty queue.
  * Return NULL if could not allocate space.
  */
 struct list_head *q_new()
 {
-    struct list_head *head = malloc(sizeof(struct list_head));
-    if (head) {
-        INIT_LIST_HEAD(head);
-        return head;
+    queue_desc_t *q = malloc(sizeof(queue_desc_t));
+    if (q) {
+        INIT_LIST_HEAD(&q->head);
+        q->flags = Q_ALL;
+        q->count = 0;
+        q->heap = false;
+        return &q->head;
     } else {
         return NULL;
     }
 }
 
+static void pq_free(struct list_head *head);
+
 /* Free all storage used by queue */
 void q_free(struct list_head *l)
 {
-    if (l) {
+    if (l && q_desc(l)->heap) {
+        pq_free(l);
+        free(q_desc(l));
+    } else if (l) {
         struct list_head *node;
         for (node = l->next; node != l;) {
             element_t *kn = container_of(node, element_t, list);
             node = node->next;
             q_release_element(kn);
         }
-        free(l);
+        free(q_desc(l));
     }
 }
 
@@ -49,7 +78,7 @@ void q_free(struct list_head *l)
  */
 bool q_insert_head(struct list_head *head, char *s)
 {
-    if (!head || !s) {
+    if (!head || !s || q_desc(head)->heap) {
         return false;
     }
     element_t *node = malloc(sizeof(element_t));
@@ -62,8 +91,9 @@ bool q_insert_head(struct list_head *head, char *s)
         return false;
     }
     list_add(&node->list, head);
+    q_desc(head)->flags &= ~Q_ORDER;
+    q_desc(head)->count++;
     return true;
-
 }
 
 /*
@@ -75,7 +105,7 @@ bool q_insert_head(struct list_head *head, char *s)
  */
 bool q_insert_tail(struct list_head *head, char *s)
 {
-    if (!head || !s) {
+    if (!head || !s || q_desc(head)->heap) {
         return false;
     }
     element_t *node = malloc(sizeof(element_t));
@@ -88,6 +118,8 @@ bool q_insert_tail(struct list_head *head, char *s)
         return false;
     }
     list_add_tail(&node->list, head);
+    q_desc(head)->flags &= ~Q_ORDER;
+    q_desc(head)->count++;
     return true;
 }
 
@@ -107,7 +139,7 @@ bool q_insert_tail(struct list_head *head, char *s)
  */
 element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
 {
-    if (!head || list_empty(head) != 0) {
+    if (!head || q_desc(head)->heap || list_empty(head) != 0) {
         return NULL;
     }
     if (sp == NULL) {
@@ -117,6 +149,7 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
     strncpy(sp, kh->value, bufsize - 1);
     sp[bufsize - 1] = '\0';
     list_del_init(&(kh->list));
+    q_desc(head)->count--;
     return kh;
 }
 
@@ -126,7 +159,7 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
 {
-    if (!head || list_empty(head) != 0) {
+    if (!head || q_desc(head)->heap || list_empty(head) != 0) {
         return NULL;
     }
     if (sp == NULL) {
@@ -136,6 +169,7 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
     strncpy(sp, kh->value, bufsize - 1);
     sp[bufsize - 1] = '\0';
     list_del_init(&(kh->list));
+    q_desc(head)->count--;
     return kh;
 }
 
@@ -157,10 +191,15 @@ int q_size(struct list_head *head)
 {
     if (!head)
         return 0;
+    queue_desc_t *q = q_desc(head);
+    if (q->heap || (q->flags & Q_COUNTED))
+        return q->count;
     int len = 0;
     struct list_head *li;
     list_for_each (li, head)
         len++;
+    q->count = len;
+    q->flags |= Q_COUNTED;
     return len;
 }
 
@@ -175,7 +214,7 @@ int q_size(struct list_head *head)
 bool q_delete_mid(struct list_head *head)
 {
     // https://leetcode.com/problems/delete-the-middle-node-of-a-linked-list/
-    if (head && head->next != head) {
+    if (head && !q_desc(head)->heap && head->next != head) {
         struct list_head *fast = head->next;
         struct list_head *slow = head->next;
         while (fast != head && fast->next != head) {
@@ -185,6 +224,7 @@ bool q_delete_mid(struct list_head *head)
         element_t *kn = container_of(slow, element_t, list);
         list_del_init(slow);
         q_release_element(kn);
+        q_desc(head)->count--;
         return true;
     } else {
         return false;
@@ -242,10 +282,17 @@ struct list_head *delete_dup(struct list_head *head, struct list_head *stay)
 bool q_delete_dup(struct list_head *head)
 {
     // https://leetcode.com/problems/remove-duplicates-from-sorted-list-ii/
-    if (!head) {
+    if (!head || q_desc(head)->heap) {
         return false;
     }
+    queue_desc_t *q = q_desc(head);
+    if (q->flags & Q_UNIQUE)
+        return true;
     head->next = delete_dup(head->next, head);
+    /* Duplicates are adjacent only in a sorted queue */
+    if (q->flags & (Q_SORTED_ASC | Q_SORTED_DESC))
+        q->flags |= Q_UNIQUE;
+    q->flags &= ~Q_COUNTED;
     return true;
 }
 
@@ -277,9 +324,10 @@ struct list_head *r_swap(struct list_head *head, struct list_head *stay)
 }
 void q_swap(struct list_head *head)
 {
-    if (head) {
+    if (head && !q_desc(head)->heap) {
         struct list_head *stay = head;
         head->next = r_swap(head->next, stay);
+        q_desc(head)->flags &= ~(Q_SORTED_ASC | Q_SORTED_DESC);
     }
     // https://leetcode.com/problems/swap-nodes-in-pairs/
 }
@@ -293,7 +341,7 @@ void q_swap(struct list_head *head)
  */
 void q_reverse(struct list_head *head)
 {
-    if (!head || head->next == head) {
+    if (!head || q_desc(head)->heap || head->next == head) {
         return;
     }
     struct list_head *stay = head;
@@ -307,6 +355,12 @@ void q_reverse(struct list_head *head)
     }
     head->next = head->prev;
     head->prev = next;
+
+    /* Ascending becomes descending and vice versa */
+    queue_desc_t *q = q_desc(head);
+    unsigned int order = q->flags & (Q_SORTED_ASC | Q_SORTED_DESC);
+    if (order == Q_SORTED_ASC || order == Q_SORTED_DESC)
+        q->flags ^= Q_SORTED_ASC | Q_SORTED_DESC;
 }
 
 /*
@@ -386,7 +440,15 @@ struct list_head *m_sort(struct list_head *head)
 }
 void q_sort(struct list_head *head)
 {
-    if (!head || head->next == head) {
+    if (!head || q_desc(head)->heap || head->next == head) {
+        return;
+    }
+    queue_desc_t *q = q_desc(head);
+    if (q->flags & Q_SORTED_ASC)
+        return;
+    /* Reversal also swaps equal strings, which a stable sort keeps in order */
+    if ((q->flags & (Q_SORTED_DESC | Q_UNIQUE)) == (Q_SORTED_DESC | Q_UNIQUE)) {
+        q_reverse(head);
         return;
     }
     head->next->prev = head->prev;
@@ -396,4 +458,313 @@ void q_sort(struct list_head *head)
     head->prev = list->prev;
     (list->prev)->next = head;
     list->prev = head;
+    q->flags |= Q_SORTED_ASC;
+}
+
+/* Max-heap of element pointers ordered by strcmp */
+static inline bool heap_less(element_t **heap, int i, int j)
+{
+    return strcmp(heap[i]->value, heap[j]->value) < 0;
+}
+
+static void heap_sift_down(element_t **heap, int n, int i)
+{
+    for (int c = 2 * i + 1; c < n; i = c, c = 2 * i + 1) {
+        if (c + 1 < n && heap_less(heap, c, c + 1))
+            c++;
+        if (!heap_less(heap, i, c))
+            return;
+        element_t *tmp = heap[i];
+        heap[i] = heap[c];
+        heap[c] = tmp;
+    }
+}
+
+/*
+ * Move the k smallest elements to the front of queue in ascending order.
+ * A max-heap holds the k smallest elements seen so far, so the pass costs
+ * O(n log k) comparisons and only the k winners are relinked.
+ */
+bool q_partial_sort(struct list_head *head, int k)
+{
+    if (!head || q_desc(head)->heap)
+        return false;
+    queue_desc_t *q = q_desc(head);
+    if (k <= 0 || (q->flags & Q_SORTED_ASC))
+        return true;
+    if (k >= q_size(head)) {
+        q_sort(head);
+        return true;
+    }
+
+    element_t **heap = malloc(sizeof(element_t *) * k);
+    if (!heap)
+        return false;
+
+    int n = 0;
+    element_t *e;
+    list_for_each_entry (e, head, list) {
+        if (n < k) {
+            heap[n++] = e;
+            if (n == k) {
+                for (int i = k / 2 - 1; i >= 0; i--)
+                    heap_sift_down(heap, k, i);
+            }
+        } else if (strcmp(e->value, heap[0]->value) < 0) {
+            heap[0] = e;
+            heap_sift_down(heap, k, 0);
+        }
+    }
+
+    /* Heap sort the survivors, largest ends up last */
+    for (int i = k - 1; i > 0; i--) {
+        element_t *tmp = heap[0];
+        heap[0] = heap[i];
+        heap[i] = tmp;
+        heap_sift_down(heap, i, 0);
+    }
+
+    for (int i = k - 1; i >= 0; i--)
+        list_move(&heap[i]->list, head);
+    free(heap);
+
+    q->flags &= ~(Q_SORTED_ASC | Q_SORTED_DESC);
+    return true;
+}
+
+/*
+ * Reallocate every element and its string in list order.
+ * All copies are made before any old block is freed; otherwise the allocator
+ * would hand the blocks just released straight back and nothing would move.
+ */
+bool q_compact(struct list_head *head)
+{
+    if (!head || q_desc(head)->heap)
+        return false;
+
+    LIST_HEAD(fresh);
+    element_t *e, *safe;
+    list_for_each_entry (e, head, list) {
+        element_t *node = malloc(sizeof(element_t));
+        if (node) {
+            node->value = strdup(e->value);
+            if (!node->value) {
+                free(node);
+                node = NULL;
+            }
+        }
+        if (!node) {
+            list_for_each_entry_safe (e, safe, &fresh, list)
+                q_release_element(e);
+            return false;
+        }
+        list_add_tail(&node->list, &fresh);
+    }
+
+    list_for_each_entry_safe (e, safe, head, list)
+        q_release_element(e);
+    INIT_LIST_HEAD(head);
+    list_splice(&fresh, head);
+    return true;
+}
+
+/*
+ * Return the flags currently known to hold for queue.
+ * If count is non-NULL and Q_COUNTED is set, store the cached size to *count.
+ */
+unsigned int q_meta(struct list_head *head, int *count)
+{
+    if (!head)
+        return 0;
+    queue_desc_t *q = q_desc(head);
+    if (count && (q->flags & Q_COUNTED))
+        *count = q->count;
+    return q->flags;
+}
+
+/* Forget everything known about the order of queue */
+void q_invalidate(struct list_head *head)
+{
+    if (head && !q_desc(head)->heap)
+        q_desc(head)->flags = 0;
+}
+
+/*
+ * Priority queue mode.
+ * The elements form a pairing heap ordered by strcmp. The list links of
+ * element_t are reused: prev points to the first child and next to the next
+ * sibling, both NULL when absent. head->next points to the root, or back to
+ * head when the heap is empty.
+ */
+static inline struct list_head *pq_root(struct list_head *head)
+{
+    return list_empty(head) ? NULL : head->next;
+}
+
+static inline void pq_set_root(struct list_head *head, struct list_head *root)
+{
+    if (root) {
+        root->next = NULL;
+        head->next = root;
+    } else {
+        INIT_LIST_HEAD(head);
+    }
+}
+
+/* Link two heap roots, the larger one becomes first child of the smaller */
+static struct list_head *pq_link(struct list_head *a, struct list_head *b)
+{
+    if (strcmp(list_entry(b, element_t, list)->value,
+               list_entry(a, element_t, list)->value) < 0) {
+        struct list_head *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    b->next = a->prev;
+    a->prev = b;
+    a->next = NULL;
+    return a;
+}
+
+/* Two-pass pairing of a sibling chain into a single root */
+static struct list_head *pq_merge_pairs(struct list_head *first)
+{
+    /* Left to right: link neighbours, stack the results in reverse */
+    struct list_head *pairs = NULL;
+    while (first) {
+        struct list_head *a = first, *b = first->next;
+        if (b) {
+            first = b->next;
+            a = pq_link(a, b);
+        } else {
+            first = NULL;
+        }
+        a->next = pairs;
+        pairs = a;
+    }
+
+    /* Right to left: fold the stack into one heap */
+    struct list_head *root = NULL;
+    while (pairs) {
+        struct list_head *next = pairs->next;
+        root = root ? pq_link(root, pairs) : pairs;
+        root->next = NULL;
+        pairs = next;
+    }
+    return root;
+}
+
+/* Release every element of heap without recursion */
+static void pq_free(struct list_head *head)
+{
+    struct list_head *node = pq_root(head);
+    while (node) {
+        if (node->prev) {
+            /* Hand the first child's siblings to node and visit it first */
+            struct list_head *child = node->prev;
+            node->prev = child->next;
+            child->next = node;
+            node = child;
+        } else {
+            struct list_head *next = node->next;
+            q_release_element(list_entry(node, element_t, list));
+            node = next;
+        }
+    }
+    INIT_LIST_HEAD(head);
+}
+
+/*
+ * Create empty priority queue.
+ * Return NULL if could not allocate space.
+ */
+struct list_head *q_pq_new()
+{
+    struct list_head *head = q_new();
+    if (head) {
+        q_desc(head)->heap = true;
+        q_desc(head)->flags = Q_COUNTED;
+    }
+    return head;
+}
+
+/*
+ * Attempt to insert element into priority queue in O(1).
+ * Return true if successful.
+ * Return false if q is NULL, not a priority queue or could not allocate space.
+ */
+bool q_pq_insert(struct list_head *head, char *s)
+{
+    if (!head || !s || !q_desc(head)->heap) {
+        return false;
+    }
+    element_t *node = malloc(sizeof(element_t));
+    if (!node) {
+        return false;
+    }
+    node->value = strdup(s);
+    if (!node->value) {
+        free(node);
+        return false;
+    }
+    node->list.prev = NULL;
+    node->list.next = NULL;
+    struct list_head *root = pq_root(head);
+    pq_set_root(head, root ? pq_link(root, &node->list) : &node->list);
+    q_desc(head)->count++;
+    return true;
+}
+
+/*
+ * Return the smallest element of priority queue without removing it.
+ * Return NULL if q is NULL, empty or not a priority queue.
+ */
+element_t *q_pq_min(struct list_head *head)
+{
+    if (!head || !q_desc(head)->heap || list_empty(head)) {
+        return NULL;
+    }
+    return list_entry(head->next, element_t, list);
+}
+
+/*
+ * Attempt to remove the smallest element from priority queue.
+ * Runs in amortized O(log n).
+ * Other attribute is as same as q_remove_head.
+ */
+element_t *q_pq_remove_min(struct list_head *head, char *sp, size_t bufsize)
+{
+    element_t *min = q_pq_min(head);
+    if (!min) {
+        return NULL;
+    }
+    if (sp) {
+        strncpy(sp, min->value, bufsize - 1);
+        sp[bufsize - 1] = '\0';
+    }
+    pq_set_root(head, pq_merge_pairs(min->list.prev));
+    INIT_LIST_HEAD(&min->list);
+    q_desc(head)->count--;
+    return min;
+}
+
+/*
+ * Move all elements of priority queue other into head in O(1).
+ * other is left empty but still allocated.
+ * Return false if either queue is NULL or not a priority queue.
+ */
+bool q_pq_meld(struct list_head *head, struct list_head *other)
+{
+    if (!head || !other || head == other || !q_desc(head)->heap ||
+        !q_desc(other)->heap) {
+        return false;
+    }
+    struct list_head *a = pq_root(head), *b = pq_root(other);
+    if (b) {
+        pq_set_root(head, a ? pq_link(a, b) : b);
+        pq_set_root(other, NULL);
+        q_desc(head)->count += q_desc(other)->count;
+        q_desc(other)->count = 0;
+    }
+    return true;
 }
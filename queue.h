@@ -131,4 +131,89 @@ void q_reverse(struct list_head *head);
  */
 void q_sort(struct list_head *head);
 
+/*
+ * Move the k smallest elements to the front of queue in ascending order,
+ * leaving the remaining elements in unspecified order.
+ * The whole queue is sorted if k is not less than its size.
+ * This function should not allocate or free any list elements.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space for the heap.
+ */
+bool q_partial_sort(struct list_head *head, int k);
+
+/*
+ * Reallocate every element and its string in list order, then free the old
+ * storage, so that consecutive elements end up close together in memory.
+ * The order and content of queue are unchanged.
+ * Return true if successful.
+ * Return false if q is NULL or could not allocate space, in which case queue
+ * is left untouched.
+ */
+bool q_compact(struct list_head *head);
+
+/*
+ * Shape facts the queue remembers about itself.
+ * Every operation that may break one of them clears the flag, and operations
+ * which can establish one for free set it again.
+ */
+#define Q_SORTED_ASC 0x1  /* Ascending order by strcmp */
+#define Q_SORTED_DESC 0x2 /* Descending order by strcmp */
+#define Q_UNIQUE 0x4      /* No two elements hold the same string */
+#define Q_COUNTED 0x8     /* Cached element count is valid */
+
+/*
+ * Return the flags currently known to hold for queue.
+ * If count is non-NULL and Q_COUNTED is set, store the cached size to *count.
+ * Return 0 if q is NULL.
+ */
+unsigned int q_meta(struct list_head *head, int *count);
+
+/*
+ * Forget everything known about the order of queue.
+ * Must be called after rearranging or unlinking nodes directly instead of
+ * through the functions above.
+ */
+void q_invalidate(struct list_head *head);
+
+/* Operations on priority queue */
+
+/*
+ * Create empty priority queue.
+ * Its elements are kept in a pairing heap ordered by strcmp, reusing the list
+ * field of element_t as child and sibling links. Only q_pq_* functions,
+ * q_size, q_meta and q_free may be applied to it. The other functions above
+ * leave it untouched and fail as they would for a NULL queue.
+ * Return NULL if could not allocate space.
+ */
+struct list_head *q_pq_new();
+
+/*
+ * Attempt to insert element into priority queue in O(1).
+ * Return true if successful.
+ * Return false if q is NULL, not a priority queue or could not allocate space.
+ * The function must explicitly allocate space and copy the string into it.
+ */
+bool q_pq_insert(struct list_head *head, char *s);
+
+/*
+ * Return the smallest element of priority queue without removing it.
+ * Return NULL if q is NULL, empty or not a priority queue.
+ */
+element_t *q_pq_min(struct list_head *head);
+
+/*
+ * Attempt to remove the smallest element from priority queue.
+ * Runs in amortized O(log n).
+ * Return NULL if q is NULL, empty or not a priority queue.
+ * If sp is non-NULL, copy the removed string to *sp as q_remove_head does.
+ */
+element_t *q_pq_remove_min(struct list_head *head, char *sp, size_t bufsize);
+
+/*
+ * Move all elements of priority queue other into head in O(1).
+ * other is left empty but still allocated.
+ * Return false if either queue is NULL or not a priority queue.
+ */
+bool q_pq_meld(struct list_head *head, struct list_head *other);
+
 #endif /* LAB0_QUEUE_H */
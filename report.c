@@ -1,3 +1,6 @@
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -5,7 +8,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
-#include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -17,23 +19,195 @@ static FILE *errfile = NULL;
 static FILE *verbfile = NULL;
 static FILE *logfile = NULL;
 
+/* Descriptors of verbose and log files, for use from a signal handler */
+static int verb_fd = STDOUT_FILENO;
+static int log_fd = -1;
+
 int verblevel = 0;
 static void init_files(FILE *efile, FILE *vfile)
 {
     errfile = efile;
     verbfile = vfile;
+    verb_fd = fileno(vfile);
 }
 
 static char fail_buf[1024] = "FATAL Error.  Exiting\n";
 
 static volatile int ret = 0;
 
+/*
+ * Optional asynchronous log sink.  Each message for the log file is copied
+ * into a ring buffer, which a writer thread drains, so reporting does not
+ * wait for the disk.  Only the main thread reports and only the writer
+ * drains, so head and tail each have a single writer and need no lock.
+ * A message that does not fit is dropped whole, and a note of how many were
+ * dropped takes its place once there is room again.
+ */
+#define LOG_RING_SIZE (1 << 20) /* Power of 2 */
+/* Fill at which the writer is woken, so it writes in large batches */
+#define LOG_RING_WAKE (LOG_RING_SIZE / 4)
+/* Milliseconds writer sleeps before looking for a smaller batch */
+#define LOG_IDLE_MS 50
+
+static struct {
+    char *buf;
+    size_t head;    /* Bytes ever added, advanced by main thread */
+    size_t tail;    /* Bytes ever written, advanced by writer */
+    bool idle;      /* Writer is about to wait on wake */
+    bool stop;      /* Writer exits once ring is empty */
+    sem_t wake;     /* Posted when writer may have work */
+    size_t dropped; /* Messages dropped since last note */
+    pthread_t writer;
+    int fd;
+} ring;
+static bool log_async = false;
+
+static void *log_writer(void *arg)
+{
+    for (;;) {
+        size_t tail = ring.tail;
+        size_t head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            /* Announce the wait before looking once more */
+            __atomic_store_n(&ring.idle, true, __ATOMIC_SEQ_CST);
+            head = __atomic_load_n(&ring.head, __ATOMIC_SEQ_CST);
+            if (head == tail) {
+                if (__atomic_load_n(&ring.stop, __ATOMIC_SEQ_CST))
+                    break;
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_nsec += LOG_IDLE_MS * 1000000L;
+                if (ts.tv_nsec >= 1000000000L) {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000L;
+                }
+                sem_timedwait(&ring.wake, &ts);
+            }
+            __atomic_store_n(&ring.idle, false, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        size_t off = tail & (LOG_RING_SIZE - 1);
+        size_t n = head - tail;
+        if (n > LOG_RING_SIZE - off)
+            n = LOG_RING_SIZE - off;
+        ssize_t w = write(ring.fd, ring.buf + off, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        /* Output that cannot be written is discarded */
+        if (w <= 0)
+            w = n;
+        __atomic_store_n(&ring.tail, tail + w, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void ring_copy(size_t pos, const char *s, size_t n)
+{
+    size_t off = pos & (LOG_RING_SIZE - 1);
+    size_t first = n < LOG_RING_SIZE - off ? n : LOG_RING_SIZE - off;
+    memcpy(ring.buf + off, s, first);
+    memcpy(ring.buf, s + first, n - first);
+}
+
+
+/* Add message to ring, or drop it when there is no room */
+static void ring_put(const char *s, size_t n)
+{
+    char note[64];
+    size_t note_len = 0;
+    if (ring.dropped)
+        note_len = snprintf(note, sizeof(note), "[%zu log messages dropped]\n",
+                            ring.dropped);
+
+    size_t head = ring.head;
+    size_t tail = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+    if (head - tail + note_len + n > LOG_RING_SIZE) {
+        ring.dropped++;
+        return;
+    }
+    ring_copy(head, note, note_len);
+    ring_copy(head + note_len, s, n);
+    ring.dropped = 0;
+    head += note_len + n;
+    __atomic_store_n(&ring.head, head, __ATOMIC_SEQ_CST);
+    if (head - tail >= LOG_RING_WAKE &&
+        __atomic_load_n(&ring.idle, __ATOMIC_SEQ_CST))
+        sem_post(&ring.wake);
+}
+
+/* Start writer thread for log file.  Return true if successful */
+static bool log_start()
+{
+    ring.buf = malloc(LOG_RING_SIZE);
+    if (!ring.buf)
+        return false;
+    if (sem_init(&ring.wake, 0, 0)) {
+        free(ring.buf);
+        return false;
+    }
+    ring.head = ring.tail = ring.dropped = 0;
+    ring.idle = ring.stop = false;
+    ring.fd = fileno(logfile);
+
+    /* Signals, such as the alarm ending a command, go to the main thread */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    bool ok = !pthread_create(&ring.writer, NULL, log_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!ok) {
+        sem_destroy(&ring.wake);
+        free(ring.buf);
+        return false;
+    }
+    log_async = true;
+    return true;
+}
+
+/* Write out everything in the ring, then end the writer thread */
+static void log_stop()
+{
+    if (!log_async)
+        return;
+    if (ring.dropped) {
+        /* Wait for room to note the drops */
+        sem_post(&ring.wake);
+        while (__atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) != ring.head)
+            sched_yield();
+        ring_put("", 0);
+    }
+    __atomic_store_n(&ring.stop, true, __ATOMIC_SEQ_CST);
+    sem_post(&ring.wake);
+    pthread_join(ring.writer, NULL);
+    sem_destroy(&ring.wake);
+    free(ring.buf);
+    log_async = false;
+}
+
+/* Write n bytes of s to the log file */
+static void log_put(const char *s, size_t n)
+{
+    if (log_async)
+        ring_put(s, n);
+    else
+        fwrite(s, 1, n, logfile);
+}
+
+static void log_close()
+{
+    log_stop();
+    log_fd = -1;
+    fclose(logfile);
+    logfile = NULL;
+}
+
 /* Default fatal function */
 static void default_fatal_fun()
 {
     ret = write(STDOUT_FILENO, fail_buf, strlen(fail_buf) + 1);
     if (logfile)
-        fputs(fail_buf, logfile);
+        log_put(fail_buf, strlen(fail_buf));
 }
 
 /* Optional function to call when fatal error encountered */
@@ -44,44 +218,172 @@ void set_verblevel(int level)
     verblevel = level;
 }
 
-bool set_logfile(char *file_name)
+static void log_exit()
 {
+    if (logfile)
+        log_close();
+}
+
+/* Write n bytes of s to fd, using only async-signal-safe calls */
+static void write_all(int fd, const char *s, size_t n)
+{
+    while (n > 0) {
+        ssize_t w = write(fd, s, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return;
+        s += w;
+        n -= w;
+    }
+}
+
+void report_crash(const char *s)
+{
+    size_t n = strlen(s);
+    write_all(verb_fd, s, n);
+    if (log_fd < 0)
+        return;
+    if (log_async) {
+        /*
+         * Writer is left running, so the end of a batch it is writing may
+         * appear twice.  Joining it is not possible from a signal handler.
+         */
+        size_t tail = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+        size_t len = ring.head - tail;
+        size_t off = tail & (LOG_RING_SIZE - 1);
+        size_t first = len < LOG_RING_SIZE - off ? len : LOG_RING_SIZE - off;
+        write_all(log_fd, ring.buf + off, first);
+        write_all(log_fd, ring.buf, len - first);
+    }
+    write_all(log_fd, s, n);
+}
+
+bool set_logfile(char *file_name, bool async)
+{
+    static bool exit_registered = false;
+    if (logfile)
+        log_close();
     logfile = fopen(file_name, "w");
-    return logfile != NULL;
+    if (!logfile)
+        return false;
+    log_fd = fileno(logfile);
+    if (!exit_registered) {
+        atexit(log_exit);
+        exit_registered = true;
+    }
+    /* Otherwise the log is written synchronously */
+    if (async)
+        log_start();
+    return true;
+}
+
+/*
+ * Each message is formatted once into a reusable buffer, which is then
+ * written to every sink.  Sinks are flushed by report_flush, once per
+ * command, rather than after every message.
+ */
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+} msg_buf_t;
+
+/* Message being reported, and line being built by report_add */
+static msg_buf_t msg;
+static msg_buf_t line;
+
+/* Make room for n more bytes and a null character */
+static bool msg_reserve(msg_buf_t *m, size_t n)
+{
+    if (m->len + n < m->cap)
+        return true;
+    size_t cap = m->cap ? m->cap : MAX_CHAR;
+    while (cap <= m->len + n)
+        cap *= 2;
+    char *buf = realloc(m->buf, cap);
+    if (!buf)
+        return false;
+    m->buf = buf;
+    m->cap = cap;
+    return true;
 }
 
-void report_event(message_t msg, char *fmt, ...)
+static void msg_vadd(msg_buf_t *m, const char *fmt, va_list ap)
+{
+    va_list aq;
+    va_copy(aq, ap);
+    int n = vsnprintf(m->buf + m->len, m->cap - m->len, fmt, aq);
+    va_end(aq);
+    if (n < 0)
+        return;
+    /* Did not fit, so grow buffer and format again */
+    if (m->len + n >= m->cap) {
+        if (!msg_reserve(m, n))
+            return;
+        vsnprintf(m->buf + m->len, m->cap - m->len, fmt, ap);
+    }
+    m->len += n;
+}
+
+static void msg_add(msg_buf_t *m, const char *s, size_t n)
+{
+    if (!msg_reserve(m, n))
+        return;
+    memcpy(m->buf + m->len, s, n);
+    m->len += n;
+}
+
+/* Write message to verbose file and log file */
+static void msg_emit(msg_buf_t *m)
+{
+    fwrite(m->buf, 1, m->len, verbfile);
+    if (logfile)
+        log_put(m->buf, m->len);
+}
+
+void report_flush()
+{
+    if (verbfile)
+        fflush(verbfile);
+    if (logfile && !log_async)
+        fflush(logfile);
+}
+
+void report_event(message_t msg_type, char *fmt, ...)
 {
     va_list ap;
-    bool fatal = msg == MSG_FATAL;
-    char *msg_name = msg == MSG_WARN    ? "WARNING"
-                     : msg == MSG_ERROR ? "ERROR"
-                                        : "FATAL ERROR";
-    int level = msg == MSG_WARN ? 2 : msg == MSG_ERROR ? 1 : 0;
+    bool fatal = msg_type == MSG_FATAL;
+    char *msg_name = msg_type == MSG_WARN    ? "WARNING"
+                     : msg_type == MSG_ERROR ? "ERROR"
+                                             : "FATAL ERROR";
+    int level = msg_type == MSG_WARN ? 2 : msg_type == MSG_ERROR ? 1 : 0;
     if (verblevel < level)
         return;
 
     if (!errfile)
         init_files(stdout, stdout);
 
+    /* The log file gets the same message under another name */
+    static const char log_name[] = "Error: ";
+    msg.len = 0;
+    msg_add(&msg, log_name, sizeof(log_name) - 1);
     va_start(ap, fmt);
-    fprintf(errfile, "%s: ", msg_name);
-    vfprintf(errfile, fmt, ap);
-    fprintf(errfile, "\n");
-    fflush(errfile);
+    msg_vadd(&msg, fmt, ap);
     va_end(ap);
+    msg_add(&msg, "\n", 1);
+
+    fprintf(errfile, "%s: ", msg_name);
+    fwrite(msg.buf + sizeof(log_name) - 1, 1, msg.len - sizeof(log_name) + 1,
+           errfile);
 
     if (logfile) {
-        va_start(ap, fmt);
-        fprintf(logfile, "Error: ");
-        vfprintf(logfile, fmt, ap);
-        fprintf(logfile, "\n");
-        fflush(logfile);
-        va_end(ap);
-        fclose(logfile);
+        log_put(msg.buf, msg.len);
+        log_close();
     }
 
     if (fatal) {
+        report_flush();
         if (fatal_fun)
             fatal_fun();
         exit(1);
@@ -95,19 +397,12 @@ void report(int level, char *fmt, ...)
 
     if (level <= verblevel) {
         va_list ap;
+        msg.len = 0;
         va_start(ap, fmt);
-        vfprintf(verbfile, fmt, ap);
-        fprintf(verbfile, "\n");
-        fflush(verbfile);
+        msg_vadd(&msg, fmt, ap);
         va_end(ap);
-
-        if (logfile) {
-            va_start(ap, fmt);
-            vfprintf(logfile, fmt, ap);
-            fprintf(logfile, "\n");
-            fflush(logfile);
-            va_end(ap);
-        }
+        msg_add(&msg, "\n", 1);
+        msg_emit(&msg);
     }
 }
 
@@ -118,17 +413,40 @@ void report_noreturn(int level, char *fmt, ...)
 
     if (level <= verblevel) {
         va_list ap;
+        msg.len = 0;
         va_start(ap, fmt);
-        vfprintf(verbfile, fmt, ap);
-        fflush(verbfile);
+        msg_vadd(&msg, fmt, ap);
         va_end(ap);
+        msg_emit(&msg);
+    }
+}
 
-        if (logfile) {
-            va_start(ap, fmt);
-            vfprintf(logfile, fmt, ap);
-            fflush(logfile);
-            va_end(ap);
-        }
+void report_start()
+{
+    line.len = 0;
+}
+
+void report_add(char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    msg_vadd(&line, fmt, ap);
+    va_end(ap);
+}
+
+void report_add_str(const char *s)
+{
+    msg_add(&line, s, strlen(s));
+}
+
+void report_end(int level)
+{
+    if (!verbfile)
+        init_files(stdout, stdout);
+
+    if (level <= verblevel) {
+        msg_add(&line, "\n", 1);
+        msg_emit(&line);
     }
 }
 
@@ -137,22 +455,22 @@ void report_noreturn(int level, char *fmt, ...)
 /* Need to be able to print without using malloc */
 static void fail_fun(char *format, char *msg)
 {
+    /* Output reported so far comes first */
+    report_flush();
     snprintf(fail_buf, sizeof(fail_buf), format, msg);
     /* Tack on return */
     fail_buf[strlen(fail_buf)] = '\n';
     /* Use write to avoid any buffering issues */
     ret = write(STDOUT_FILENO, fail_buf, strlen(fail_buf) + 1);
 
-    if (logfile) {
-        /* Don't know file descriptor for logfile */
-        fputs(fail_buf, logfile);
-    }
+    if (logfile)
+        log_put(fail_buf, strlen(fail_buf));
 
     if (fatal_fun)
         fatal_fun();
 
     if (logfile)
-        fclose(logfile);
+        log_close();
 
     exit(1);
 }
@@ -280,9 +598,9 @@ void init_time(double *timep)
 
 double delta_time(double *timep)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    double current_time = tv.tv_sec + 1.0E-6 * tv.tv_usec;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double current_time = ts.tv_sec + 1.0E-9 * ts.tv_nsec;
     double delta = current_time - *timep;
     *timep = current_time;
     return delta;
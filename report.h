@@ -17,7 +17,11 @@ typedef enum { MSG_WARN, MSG_ERROR, MSG_FATAL } message_t;
 /* Buffer sizes */
 #define MAX_CHAR 512
 
-bool set_logfile(char *file_name);
+/*
+ * Copy output to file_name.  With async, a background thread writes it,
+ * dropping messages when it falls more than a megabyte behind.
+ */
+bool set_logfile(char *file_name, bool async);
 
 extern int verblevel;
 void set_verblevel(int level);
@@ -31,6 +35,22 @@ void report(int verblevel, char *fmt, ...);
 /* Like report, but without return character */
 void report_noreturn(int verblevel, char *fmt, ...);
 
+/* Build line of output in pieces, then report it at once with report_end */
+void report_start();
+void report_add(char *fmt, ...);
+void report_add_str(const char *s);
+void report_end(int verblevel);
+
+/* Write out what was reported.  Done after every command */
+void report_flush();
+
+/*
+ * Write s to the verbose and log files from a signal handler, after what
+ * the log writer thread has not yet written.  Only write(2) is used, so
+ * output still buffered in a FILE is lost.
+ */
+void report_crash(const char *s);
+
 /* Attempt to call malloc.  Fail when returns NULL */
 void *malloc_or_fail(size_t bytes, char *fun_name);
 
@@ -4,6 +4,8 @@ from __future__ import print_function
 import subprocess
 import sys
 import getopt
+import os
+import tempfile
 
 
 
@@ -35,7 +37,20 @@ class Tracer:
         14: "trace-14-perf",
         15: "trace-15-perf",
         16: "trace-16-perf",
-        17: "trace-17-complexity"
+        17: "trace-17-complexity",
+        18: "trace-18-topk",
+        19: "trace-19-compact",
+        20: "trace-20-repeat",
+        21: "trace-21-queues",
+        22: "trace-22-pq",
+        23: "trace-23-cq",
+        24: "trace-24-meta",
+        25: "trace-25-replay"
+    }
+
+    # Traces run by compiling another trace with -b and replaying the result
+    replayDict = {
+        25: 23
     }
 
     traceProbs = {
@@ -55,10 +70,18 @@ class Tracer:
         14: "Trace-14",
         15: "Trace-15",
         16: "Trace-16",
-        17: "Trace-17"
+        17: "Trace-17",
+        18: "Trace-18",
+        19: "Trace-19",
+        20: "Trace-20",
+        21: "Trace-21",
+        22: "Trace-22",
+        23: "Trace-23",
+        24: "Trace-24",
+        25: "Trace-25"
     }
 
-    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5]
+    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5, 5, 5, 5, 5, 5, 5, 5, 5]
 
     RED = '\033[91m'
     GREEN = '\033[92m'
@@ -82,14 +105,8 @@ class Tracer:
             color = self.WHITE
         print(color, text, self.WHITE, sep = '')
 
-    def runTrace(self, tid):
-        if not tid in self.traceDict:
-            self.printInColor("ERROR: No trace with id %d" % tid, self.RED)
-            return False
-        fname = "%s/%s.cmd" % (self.traceDirectory, self.traceDict[tid])
-        vname = "%d" % self.verbLevel
-        clist = self.command + ["-v", vname, "-f", fname]
-
+    def runQtest(self, args):
+        clist = self.command + ["-v", "%d" % self.verbLevel] + args
         try:
             retcode = subprocess.call(clist)
         except Exception as e:
@@ -97,6 +114,23 @@ class Tracer:
             return False
         return retcode == 0
 
+    def runReplay(self, tid):
+        src = self.replayDict[tid]
+        fname = "%s/%s.cmd" % (self.traceDirectory, self.traceDict[src])
+        with tempfile.TemporaryDirectory() as tmpdir:
+            bname = os.path.join(tmpdir, "%s.qbc" % self.traceDict[src])
+            return self.runQtest(["-f", fname, "-b", bname]) and \
+                self.runQtest(["-f", bname])
+
+    def runTrace(self, tid):
+        if not tid in self.traceDict:
+            self.printInColor("ERROR: No trace with id %d" % tid, self.RED)
+            return False
+        if tid in self.replayDict:
+            return self.runReplay(tid)
+        fname = "%s/%s.cmd" % (self.traceDirectory, self.traceDict[tid])
+        return self.runQtest(["-f", fname])
+
     def run(self, tid=0):
         scoreDict = {k: 0 for k in self.traceDict.keys()}
         print("---\tTrace\t\tPoints")
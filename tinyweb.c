@@ -244,6 +244,11 @@ int open_listenfd(int port)
     if (listen(listenfd, LISTENQ) < 0) {
         return -1;
     }
+
+    /* The console event loop accepts until no connection is pending */
+    if (fcntl(listenfd, F_SETFL, O_NONBLOCK) < 0) {
+        return -1;
+    }
     return listenfd;
 }
 
@@ -263,27 +268,21 @@ void url_decode(char *src, char *dest, int max)
     *dest = '\0';
 }
 
-void parse_request(int fd, http_request *req)
+/* Fill in offset and end of req from Range header line */
+static void parse_range(const char *line, http_request *req)
 {
-    rio_t rio;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
-    req->offset = 0;
-    req->end = 0; /* default */
-
-    rio_readinitb(&rio, fd);
-    rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%1023s %1023s", method, uri); /* version is not cared */
-    /* read all */
-    while (buf[0] != '\n' && buf[1] != '\n') { /* \n || \r\n */
-        rio_readlineb(&rio, buf, MAXLINE);
-        if (buf[0] == 'R' && buf[1] == 'a' && buf[2] == 'n') {
-            sscanf(buf, "Range: bytes=%zu-%zu", &req->offset, &req->end);
-            // Range: [start, end]
-            if (req->end != 0) {
-                req->end++;
-            }
+    if (line[0] == 'R' && line[1] == 'a' && line[2] == 'n') {
+        sscanf(line, "Range: bytes=%zu-%zu", &req->offset, &req->end);
+        // Range: [start, end]
+        if (req->end != 0) {
+            req->end++;
         }
     }
+}
+
+/* Fill in filename of req from request uri */
+static void parse_uri(char *uri, http_request *req)
+{
     char *filename = uri;
     if (uri[0] == '/') {
         filename = uri + 1;
@@ -300,7 +299,40 @@ void parse_request(int fd, http_request *req)
             }
         }
     }
-    url_decode(filename, req->filename, MAXLINE);
+    url_decode(filename, req->filename, sizeof(req->filename));
+}
+
+void parse_request(int fd, http_request *req)
+{
+    rio_t rio;
+    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
+    req->offset = 0;
+    req->end = 0; /* default */
+
+    rio_readinitb(&rio, fd);
+    rio_readlineb(&rio, buf, MAXLINE);
+    sscanf(buf, "%1023s %1023s", method, uri); /* version is not cared */
+    /* read all */
+    while (buf[0] != '\n' && buf[1] != '\n') { /* \n || \r\n */
+        rio_readlineb(&rio, buf, MAXLINE);
+        parse_range(buf, req);
+    }
+    parse_uri(uri, req);
+}
+
+bool tinyweb_parse(char *buf, http_request *req)
+{
+    char method[MAXLINE], uri[MAXLINE] = "";
+    if (!strstr(buf, "\r\n\r\n") && !strstr(buf, "\n\n"))
+        return false;
+
+    req->offset = 0;
+    req->end = 0; /* default */
+    sscanf(buf, "%1023s %1023s", method, uri); /* version is not cared */
+    for (char *line = strchr(buf, '\n'); line; line = strchr(line, '\n'))
+        parse_range(++line, req);
+    parse_uri(uri, req);
+    return true;
 }
 
 void print_help()
@@ -360,10 +392,16 @@ int tinyweb_main(int argc, char **argv)
 }
 
 // Tinyweb accept connection
-// Return connection fd
+// Return non-blocking connection fd
+// Return -1 if no connection is pending or failed.
 int tinyweb_accept(int listenfd)
 {
     struct sockaddr_in clientaddr;
     socklen_t clientlen = sizeof clientaddr;
-    return accept(listenfd, (SA *) &clientaddr, &clientlen);
+    int connfd = accept(listenfd, (SA *) &clientaddr, &clientlen);
+    if (connfd >= 0 && fcntl(connfd, F_SETFL, O_NONBLOCK) < 0) {
+        close(connfd);
+        return -1;
+    }
+    return connfd;
 }
\ No newline at end of file
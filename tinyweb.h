@@ -1,6 +1,7 @@
 #ifndef __TINY_H
 #define __TINY_H
 
+#include <stdbool.h>
 #include <sys/types.h>
 
 typedef struct {
@@ -18,4 +19,8 @@ int tinyweb_accept(int listenfd);
 // Process http request
 void parse_request(int fd, http_request *req);
 
+// Process http request held in null-terminated buf
+// Return false if the request headers are not complete yet
+bool tinyweb_parse(char *buf, http_request *req);
+
 #endif /* __TINY_H */
\ No newline at end of file
@@ -0,0 +1,14 @@
+# Test performance of partial sort against full sort
+# topk is expected to take a small fraction of the time of sort
+option fail 0
+option malloc 0
+new
+ih RAND 200000
+time topk 100
+time sort
+free
+new
+ih RAND 200000
+reverse
+time topk 10000
+time sort
@@ -0,0 +1,17 @@
+# Test compaction of queue nodes into list order after sort
+# Traversal time after compact is expected to drop well below the time before
+option fail 0
+option malloc 0
+new
+ih RAND 200000
+sort
+compact
+size
+free
+option compact 100000
+new
+ih RAND 200000
+time sort
+reverse
+rh
+free
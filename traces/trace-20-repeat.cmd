@@ -0,0 +1,25 @@
+# Test repeat blocks and their counters
+option fail 0
+option malloc 0
+new
+repeat 1000 i {
+it key$i
+}
+repeat 1000 i {
+rh key$i
+}
+repeat 20 i {
+repeat 50 j {
+it v$i-$j
+}
+repeat 50 j {
+rh v$i-$j
+}
+}
+repeat 3 i {
+ih last
+}
+rh last
+rt last
+rh last
+free
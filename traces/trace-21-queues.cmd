@@ -0,0 +1,35 @@
+# Test named queues and moving elements between them
+option fail 0
+option malloc 0
+new
+it b
+it d
+it f
+new other
+it a
+it c
+it d
+it g
+use default
+merge other
+size
+use other
+size
+ih x
+ih y
+use default
+splice other
+move other 3
+rh d
+rh d
+rh f
+rh g
+rh y
+rh x
+free
+use other
+size
+rh a
+rh b
+rh c
+free
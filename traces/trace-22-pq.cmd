@@ -0,0 +1,36 @@
+# Test priority queue insert, meld and pop order
+option fail 10
+option malloc 0
+pnew
+ppop
+pins dolphin
+pins bear
+pins gerbil
+pins bear
+pins ant 3
+pmeld cat 2
+pmeld zebra
+pins meerkat
+ppop ant
+ppop ant
+ppop ant
+ppop bear
+ppop bear
+ppop cat
+ppop cat
+ppop dolphin
+pins aardvark
+ppop aardvark
+ppop gerbil
+ppop meerkat
+ppop zebra
+ppop
+pins RAND 1000
+pmeld RAND 1000
+pfree
+pnew
+pins RAND 500
+new
+ih fox
+free
+pfree
@@ -0,0 +1,96 @@
+# Test compact queue operations and arena compaction
+option fail 10
+option malloc 0
+cq new
+cq rh
+cq ih dolphin
+cq ih bear
+cq it gerbil
+cq it meerkat
+cq rh bear
+cq rt meerkat
+cq rh dolphin
+cq rt gerbil
+cq rt
+cq it zebra
+cq it bear
+cq it dolphin
+cq it bear
+cq it ant
+cq it cat 2
+cq sort
+cq rh ant
+cq rh bear
+cq rh bear
+cq ih ant
+cq dedup
+cq rh ant
+cq rh dolphin
+cq rh zebra
+cq size
+cq it a
+cq it b
+cq it c
+cq it d
+cq it e
+cq dm
+cq swap
+cq rh b
+cq rh a
+cq rh e
+cq rh d
+cq it a
+cq it b
+cq it c
+cq it d
+cq reverse
+cq rh d
+cq rh c
+cq rt a
+cq rt b
+cq free
+cq new
+cq it aaaaaaaaaaaaaaa 25
+cq it bbbbbbbbbbbbbbb
+cq it ccccccccccccccc
+cq it ddddddddddddddd
+cq it eeeeeeeeeeeeeee
+cq it fffffffffffffff
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq rh aaaaaaaaaaaaaaa
+cq it zzzzzzzzzzzzzzz 3
+cq rh bbbbbbbbbbbbbbb
+cq rh ccccccccccccccc
+cq rh ddddddddddddddd
+cq rh eeeeeeeeeeeeeee
+cq rh fffffffffffffff
+cq rt zzzzzzzzzzzzzzz
+cq rt zzzzzzzzzzzzzzz
+cq rt zzzzzzzzzzzzzzz
+cq rh
+cq it RAND 1000
+cq sort
+cq free
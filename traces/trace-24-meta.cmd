@@ -0,0 +1,57 @@
+# Test shape flags the queue keeps across sort, dedup, merge, move and splice
+option fail 0
+option malloc 0
+new
+meta asc desc unique counted
+it b
+it a
+it b
+it c
+meta counted
+sort
+meta asc counted
+dedup
+meta asc unique
+rh a
+rh c
+free
+new
+it d
+it a
+it c
+sort
+meta asc counted
+dedup
+meta asc unique
+size
+meta asc unique counted
+reverse
+meta desc unique counted
+new other
+it b
+it e
+sort
+meta asc counted
+use default
+sort
+meta asc unique counted
+merge other
+meta none
+sort
+size
+meta asc counted
+move other 2
+meta none
+use other
+meta none
+sort
+size
+meta asc counted
+use default
+splice other
+meta none
+use other
+meta none
+free
+use default
+free